@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs the driver's KUnit suite with kunit_tool on an x86_64 QEMU guest
+# The driver is copied into drivers/misc/sandpiper of the given kernel tree, and its Kconfig and Makefile hooked up there
+# usage: ./kunit.sh <kernel source tree>
+
+set -e
+
+if [ -z "$1" ] || [ ! -f "$1/drivers/misc/Kconfig" ]; then
+	echo "usage: $0 <kernel source tree>"
+	exit 1
+fi
+
+KERNEL_SRC=$(cd "$1" && pwd)
+HERE=$(cd "$(dirname "$0")" && pwd)
+DEST=$KERNEL_SRC/drivers/misc/sandpiper
+
+mkdir -p "$DEST"
+cp "$HERE/Kconfig" "$HERE/Makefile" "$HERE/.kunitconfig" "$HERE/sandpiper.c" "$HERE/sandpiper_test.c" "$HERE/sandpiper_trace.h" "$DEST/"
+
+# drivers/misc/Kconfig ends with endmenu, the driver goes just before it
+grep -q 'drivers/misc/sandpiper/Kconfig' "$KERNEL_SRC/drivers/misc/Kconfig" || sed -i '$i source "drivers/misc/sandpiper/Kconfig"' "$KERNEL_SRC/drivers/misc/Kconfig"
+grep -q 'sandpiper/' "$KERNEL_SRC/drivers/misc/Makefile" || echo 'obj-$(CONFIG_SANDPIPER)		+= sandpiper/' >> "$KERNEL_SRC/drivers/misc/Makefile"
+
+cd "$KERNEL_SRC"
+./tools/testing/kunit/kunit.py run --arch=x86_64 --kunitconfig=drivers/misc/sandpiper
@@ -10,6 +10,53 @@
 #include <linux/uaccess.h>
 #include <linux/ioctl.h>
 #include <linux/of.h>
+#include <linux/mutex.h>
+#include <linux/capability.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/genalloc.h>
+#include <linux/fb.h>
+#include <linux/aperture.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/delay.h>
+#include <linux/sched/signal.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/kref.h>
+#include <linux/dma-buf.h>
+#include <linux/file.h>
+#include <linux/dma-mapping.h>
+#include <linux/iosys-map.h>
+#include <linux/uio_driver.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_gem.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_ioctl.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+#include <drm/drm_vblank.h>
+#ifdef CONFIG_ARM
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "sandpiper_trace.h"
 
 // Shared memory physical address
 #define PHYS_ADDR 0x18000000
@@ -22,9 +69,61 @@
 
 // 32Mbytes reserved for device access
 #define RESERVED_MEMORY_SIZE	0x2000000
+
+// The linux console framebuffer (simple-framebuffer, 640x480 r5g6b5) sits at the start of the reserved memory
+#define CONSOLE_FRAMEBUFFER_ADDR	PHYS_ADDR
+#define CONSOLE_FRAMEBUFFER_SIZE	(640*480*2)
+
+// The last megabyte of the reserved memory holds buffers owned by the driver itself
+#define DRIVER_MEMORY_SIZE		0x100000
+#define DRIVER_MEMORY_ADDR		(PHYS_ADDR + RESERVED_MEMORY_SIZE - DRIVER_MEMORY_SIZE)
+
+// Everything in between is handed out by the driver's allocator
+#define POOL_MEMORY_ADDR		(CONSOLE_FRAMEBUFFER_ADDR + CONSOLE_FRAMEBUFFER_SIZE)
+#define POOL_MEMORY_SIZE		(DRIVER_MEMORY_ADDR - POOL_MEMORY_ADDR)
+
+// ALSA playback ring buffer, each period is handed to the APU as one buffer
+#define PCM_BUFFER_ADDR			DRIVER_MEMORY_ADDR
+#define PCM_BUFFER_SIZE			0x10000
+#define PCM_PERIOD_BYTES_MIN	256
+#define PCM_PERIOD_BYTES_MAX	(PCM_BUFFER_SIZE / 2)
+
+// VCP programs are staged right after it, alternating between two slots so a load never overwrites a program still being fetched
+#define VCP_PROGRAM_ADDR		(PCM_BUFFER_ADDR + PCM_BUFFER_SIZE)
+#define VCP_PROGRAM_SLOT_SIZE	0x8000
+#define VCP_PROGRAM_SLOTS		2
+
+// Shared command ring after the VCP slots, one header page followed by the entries
+#define COMMAND_RING_ADDR		(VCP_PROGRAM_ADDR + VCP_PROGRAM_SLOTS * VCP_PROGRAM_SLOT_SIZE)
+#define COMMAND_RING_ENTRIES	2048
+#define COMMAND_RING_SIZE		(PAGE_SIZE + COMMAND_RING_ENTRIES * sizeof(struct SPRingEntry))
+// Entries drained between publishing progress to producers
+#define COMMAND_RING_BATCH		64
+
+// Read-only status page after the command ring, refreshed by the event timer
+#define STATUS_PAGE_ADDR		(COMMAND_RING_ADDR + PAGE_ALIGN(COMMAND_RING_SIZE))
 // Device region of access (4Kbytes each)
 #define DEVICE_MEMORY_SIZE		0x1000
 
+// Reads at this offset of the video control registers return the VPU vblank counter
+#define VIDEO_STATUS_OFFSET		0
+// Reads at this offset of the audio control registers return the APU buffer (frame) counter
+#define AUDIO_STATUS_OFFSET		0
+// Reads at this offset of the VCP control registers return the VCP state word
+#define VCP_STATUS_OFFSET		0
+// Reads at this offset of the audio, video and VCP control registers return the number of words waiting in the command FIFO
+#define FIFO_LEVEL_OFFSET		1
+// Command FIFO depth in words, the same for all three units
+#define FIFO_DEPTH_WORDS		512
+// Sleep range of a submit waiting for FIFO space
+#define FIFO_WAIT_MIN_US		20
+#define FIFO_WAIT_MAX_US		50
+// Longest a submit waits for FIFO space before giving up on a unit that stopped consuming
+#define FIFO_WAIT_TIMEOUT_MS	100
+// Limits of the event polling interval, the timer runs in hardirq context so it can't be allowed to spin
+#define EVENT_POLL_US_MIN		100
+#define EVENT_POLL_US_MAX		100000
+
 // Character device name
 #define DEVICE_NAME "sandpiper"
 
@@ -41,6 +140,32 @@
 #define SP_IOCTL_PALETTE_READ		_IOR('k', 9, void*)
 #define SP_IOCTL_PALETTE_WRITE		_IOW('k', 10, void*)
 #define SP_IOCTL_GET_VCP_CTL		_IOR('k', 11, void*)
+#define SP_IOCTL_VPU_SUBMIT			_IOW('k', 12, void*)
+#define SP_IOCTL_REG_PROGRAM		_IOWR('k', 13, void*)
+#define SP_IOCTL_SET_MAP_MODE		_IOW('k', 14, void*)
+#define SP_IOCTL_CACHE_SYNC			_IOW('k', 15, void*)
+#define SP_IOCTL_SET_EVENT_MASK		_IOW('k', 16, void*)
+#define SP_IOCTL_ALLOC				_IOWR('k', 17, void*)
+#define SP_IOCTL_FREE				_IOW('k', 18, void*)
+#define SP_IOCTL_EXPORT				_IOWR('k', 19, void*)
+#define SP_IOCTL_PALETTE_LOAD		_IOW('k', 20, void*)
+#define SP_IOCTL_VCP_LOAD			_IOW('k', 21, void*)
+#define SP_IOCTL_RING_DOORBELL		_IO('k', 22)
+#define SP_IOCTL_FIFO_STATUS		_IOWR('k', 23, void*)
+// io_uring only command, completes on the next event in the SPEventWait mask
+#define SP_URING_WAIT_EVENT			_IOW('k', 24, void*)
+// Room for every ioctl number above, sizes the debugfs statistics
+#define SP_IOCTL_NR_COUNT			32
+// log2 buckets of the ioctl latency histograms, in nanoseconds
+#define LATENCY_BUCKETS				32
+
+// Number of command words staged on the kernel stack per FIFO burst
+#define SUBMIT_CHUNK_WORDS		64
+// Number of register operations staged on the kernel stack per batch
+#define REGPROGRAM_CHUNK_OPS	16
+
+// Number of entries in the palette block
+#define PALETTE_ENTRIES			256
 
 // Video mode control word
 #define MAKEVMODEINFO(_cmode, _vmode, _scanEnable) ((_cmode&0x1)<<2) | ((_vmode&0x1)<<1) | (_scanEnable&0x1)
@@ -91,6 +216,8 @@ enum EVideoScanoutEnable
 #define VCPSETBUFFERSIZE	0x0
 #define VCPSTARTDMA			0x1
 #define VCPEXEC				0x2
+// Execution flags live above the 4 bit opcode of the VCPEXEC command word
+#define VCPEXEC_FLAGS_MASK	0xFFFFFFF0
 
 enum EAPUSampleRate
 {
@@ -100,13 +227,206 @@ enum EAPUSampleRate
 	ASR_Halt = 3,		// Halt
 };
 
+// Register blocks addressable by a register program
+enum ERegisterBlock
+{
+	ERB_Audio,
+	ERB_Video,
+	ERB_Palette,
+	ERB_VCP,
+	ERB_Count
+};
+
+// Register program operations
+enum ERegisterOp
+{
+	ERO_Read,		// value = reg
+	ERO_Write,		// reg = value
+	ERO_MaskWrite,	// reg = (reg & ~mask) | (value & mask), value = previous reg
+	ERO_Count
+};
+
+// Memory type used for subsequent mmaps of the shared memory region
+enum EMapMode
+{
+	EMM_Uncached,		// Default, always coherent with scanout/APU/VCP
+	EMM_WriteCombine,	// Buffered writes, uncached reads
+	EMM_Cached,			// Fully cached, needs SP_IOCTL_CACHE_SYNC around device access, the only mode it is valid in
+	EMM_Count
+};
+
+// Cache maintenance operations on the shared memory region
+enum ECacheOp
+{
+	ECO_Clean,		// Make CPU writes visible to the device
+	ECO_Invalidate,	// Drop stale lines before reading device writes
+	ECO_Flush,		// Clean and invalidate
+	ECO_Count
+};
+
+// When SP_IOCTL_PALETTE_LOAD writes reach the palette block
+enum EPaletteLatch
+{
+	EPL_Immediate,		// Write right away, may change colors mid-frame
+	EPL_VBlank,			// Stage in the driver and write at the next vblank
+	EPL_Count
+};
+
+// Event types delivered through read() on the device
+enum EEventType
+{
+	EET_VBlank,			// VPU vblank counter advanced, value holds the new counter
+	EET_AudioBuffer,	// APU finished a buffer, value holds the APU frame counter (current play position)
+	EET_Count
+};
+
+#define EVENT_MASK(_type)	(1u << (_type))
+#define EVENT_MASK_ALL		(EVENT_MASK(EET_Count) - 1)
+
 struct SPIoctl
 {
 	uint32_t offset;	// Offset within the control register
 	uint32_t value;		// Value read or value to write
 };
 
+struct SPSubmit
+{
+	uint32_t count;		// Number of 32-bit command words to push
+	uint32_t words;		// User pointer to the command words
+};
+
+struct SPRegOp
+{
+	uint32_t block;		// Register block to access (ERegisterBlock)
+	uint32_t offset;	// Offset within the control register
+	uint32_t value;		// Value read or value to write
+	uint32_t op;		// Operation to perform (ERegisterOp)
+	uint32_t mask;		// Bits to modify for ERO_MaskWrite
+};
+
+struct SPRegProgram
+{
+	uint32_t count;		// Number of SPRegOp entries
+	uint32_t ops;		// User pointer to the SPRegOp entries, read results are written back in place
+};
+
+struct SPCacheOp
+{
+	uint32_t offset;	// Byte offset from the start of the shared memory region
+	uint32_t size;		// Size of the range in bytes
+	uint32_t op;		// Cache operation (ECacheOp)
+};
+
+struct SPAlloc
+{
+	uint32_t size;		// Size of the allocation in bytes, rounded up to whole pages
+	uint32_t address;	// Physical address of the allocation, also the mmap offset to use for it
+};
+
+struct SPExport
+{
+	uint32_t address;	// Physical address of an allocation owned by the caller
+	uint32_t flags;		// O_CLOEXEC and O_RDWR/O_RDONLY for the new file descriptor
+	int32_t fd;			// dma-buf file descriptor returned by the driver
+};
+
+struct SPPalette
+{
+	uint32_t first;		// First palette index to load
+	uint32_t count;		// Number of entries to load
+	uint32_t entries;	// User pointer to the 32-bit palette entries
+	uint32_t latch;		// When to load them (EPaletteLatch)
+};
+
+struct SPVCPProgram
+{
+	uint32_t size;		// Program size in bytes, a multiple of 4 up to VCP_PROGRAM_SLOT_SIZE
+	uint32_t program;	// User pointer to the program words
+	uint32_t execflags;	// Flags OR'd into the VCPEXEC command that starts the program, within VCPEXEC_FLAGS_MASK
+};
+
+// Command ring protocol, the ring is mmapped cached at COMMAND_RING_ADDR by CAP_SYS_RAWIO clients only, since it feeds every FIFO:
+// A producer reserves n consecutive entries by advancing head with compare-and-swap, as long as
+// head + n - tail <= entries. It fills in block and word of each entry, then stores sequence = position + 1
+// with release semantics, and finally rings SP_IOCTL_RING_DOORBELL. The driver drains entries in order,
+// stopping at the first one that isn't published yet, so a reservation reaches the FIFO as one unbroken run.
+// The ring is reset on the last close of the device, which also drops anything reserved but never published.
+struct SPRingHeader
+{
+	uint32_t head;			// Next position producers will reserve
+	uint32_t reserved0[7];	// Keeps head and tail on separate cache lines
+	uint32_t tail;			// Next position the driver will drain, written by the driver only
+	uint32_t reserved1[7];
+	uint32_t entries;		// Number of entries in the ring, a power of two
+	uint32_t errors;		// Entries skipped for naming a block without a command FIFO, or audio while ALSA owns the APU
+};
+
+struct SPRingEntry
+{
+	uint32_t sequence;		// Position + 1 once the entry is published
+	uint32_t block;			// Command FIFO to write to (ERB_Audio, ERB_Video or ERB_VCP)
+	uint32_t word;			// Command word
+	uint32_t reserved;
+};
+
+struct SPFifoStatus
+{
+	uint32_t block;		// Command FIFO to query (ERB_Audio, ERB_Video or ERB_VCP)
+	uint32_t level;		// Words waiting in the FIFO
+	uint32_t space;		// Words that can be written without waiting
+	uint32_t depth;		// FIFO size in words
+	uint32_t overflows;	// Times a submit found the FIFO too full and had to wait or return -EAGAIN
+};
+
+// Status page protocol, the page is mmapped read-only and cached at STATUS_PAGE_ADDR:
+// The driver makes sequence odd before changing any field and even again once done. A reader loads sequence,
+// waits for it to be even, reads the fields it needs, then loads sequence again and retries if it changed.
+// Fields are only refreshed while the event timer runs, which mapping the page takes care of.
+struct SPStatusPage
+{
+	uint32_t sequence;				// Odd while the driver is updating the page
+	uint32_t vblank_count;			// Last vblank counter read from the VPU
+	uint32_t vblank_sequence;		// Vblanks seen by the driver
+	uint32_t swap_sequence;			// Vblanks that latched video commands queued through the driver
+	uint64_t vblank_time;			// CLOCK_MONOTONIC time in nanoseconds of the last vblank
+	uint64_t swap_time;				// Same, for the last vblank counted in swap_sequence
+	uint32_t audio_count;			// Last buffer counter read from the APU
+	uint32_t audio_sequence;		// Audio buffers seen by the driver
+	uint64_t audio_time;			// Time the APU moved on to its current buffer
+	uint32_t fifo_level[ERB_Count];	// Words waiting in each command FIFO, zero for blocks without one
+	uint32_t vcp_status;			// Last VCP state word
+	uint32_t vcp_slot;				// Next VCP program staging slot
+	uint64_t update_time;			// Time of the last refresh
+};
+
+// io_uring commands reuse the ioctl numbers, with the ioctl argument struct placed in the SQE command area.
+// SP_URING_WAIT_EVENT completes with the EEventType as result, and the event timestamp as the second result on CQE32 rings.
+struct SPEventWait
+{
+	uint32_t mask;		// EVENT_MASK() bits of the events to wait for
+};
+
+struct SPEvent
+{
+	uint32_t type;		// Event type (EEventType)
+	uint32_t sequence;	// Number of events of this type seen by the driver
+	uint64_t timestamp;	// CLOCK_MONOTONIC time in nanoseconds at which the event was observed
+	uint32_t value;		// Event specific payload
+	uint32_t reserved;
+};
+
+struct my_driver_data;
+
+// Register accessors, every register read and command FIFO write in the driver goes through one of these.
+// sp_mmio_reg_ops talks to the fabric, a fake backend can stand in for it to run the driver without hardware.
+struct sp_reg_ops {
+	uint32_t (*read)(struct my_driver_data *, uint32_t block, uint32_t offset);
+	void (*write)(struct my_driver_data *, uint32_t block, uint32_t offset, uint32_t value);
+	void (*write_rep)(struct my_driver_data *, uint32_t block, const uint32_t *words, uint32_t count);	// count words to offset 0
+};
+
 struct my_driver_data {
+	const struct sp_reg_ops *reg_ops;
 	volatile uint32_t *audio_ctl;	// User side code has to mmap this address when accessing audio control registers
 	volatile uint32_t *video_ctl;	// User side code has to mmap this address when accessing video control registers
 	volatile uint32_t *palette_ctl;	// User side code has to mmap this address when accessing palette registers
@@ -114,21 +434,223 @@ struct my_driver_data {
     struct cdev cdev;
     struct device *device;
 	uint32_t open_count;
+	struct mutex fifo_lock;			// Keeps batched command streams from interleaving
+	uint32_t vcp_slot;				// Next VCP program staging slot, guarded by fifo_lock
+	uint32_t fifo_overflows[ERB_Count];	// Per block count of submits that found the FIFO full, guarded by fifo_lock
+	struct work_struct ring_work;	// Drains the command ring into the FIFOs
+	uint32_t ring_tail;				// Driver's own copy of the ring tail, user space can't move it
+	void *shared_mem;				// Cached kernel mapping of the shared memory region, used for cache maintenance
+
+	// The fabric has no interrupt lines to the PS, so events are found by polling status registers
+	struct hrtimer event_timer;
+	struct mutex event_users_lock;	// Serializes starting and stopping the event timer
+	uint32_t event_users;			// Number of files that have used read() or poll()
+	spinlock_t event_lock;
+	wait_queue_head_t event_wait;
+	uint32_t vblank_status;			// Last vblank counter read from the VPU
+	uint32_t vblank_sequence;
+	ktime_t vblank_time;
+	uint32_t audio_status;			// Last frame counter read from the APU
+	uint32_t audio_sequence;
+	ktime_t audio_time;
+	uint64_t status_video_bytes;	// Video FIFO bytes already accounted for in the status page swap fields
+	struct list_head uring_waiters;	// SP_URING_WAIT_EVENT commands, guarded by event_lock
+	uint32_t palette_staged[PALETTE_ENTRIES];	// Entries waiting for the next vblank, guarded by event_lock
+	DECLARE_BITMAP(palette_dirty, PALETTE_ENTRIES);	// Staged entries not written yet
+
+	// ALSA playback, periods are fed to the APU one buffer at a time as it consumes them
+	struct snd_card *card;
+	struct snd_pcm_substream *pcm_substream;
+	void *pcm_buffer;				// Write-combined kernel mapping of the PCM ring buffer
+	spinlock_t pcm_lock;
+	bool pcm_running;
+	uint32_t pcm_period_bytes;
+	uint32_t pcm_periods;
+	uint32_t pcm_playing;			// Period the APU is currently playing
+
+	struct gen_pool *mem_pool;		// Allocator for the pool part of the reserved memory
+
+	// Native fbdev console, replaces simple-framebuffer when registered
+	struct fb_info *fb_info;
+
+	// DRM/KMS scanout, active while the display pipe is enabled
+	struct sp_drm *drm;
+	bool drm_active;
+
+	// UIO binding for userspace drivers, the event timer stands in for the missing interrupt line
+	struct uio_info *uio_info;
+
+	// Statistics exposed through debugfs
+	struct dentry *debugfs;
+	atomic64_t ioctl_calls[SP_IOCTL_NR_COUNT];
+	atomic64_t ioctl_latency[SP_IOCTL_NR_COUNT][LATENCY_BUCKETS];
+	atomic64_t fifo_bytes[ERB_Count];	// Bytes written to each block through the driver
+	atomic64_t mmap_count;
+};
+
+struct my_file_data {
+	struct my_driver_data *drvdata;
+	uint32_t map_mode;				// EMapMode used for shared memory mmaps on this file
+	bool events_enabled;			// This file counts towards event_users
+	uint32_t event_mask;			// EVENT_MASK() bits of the events this file wants
+	uint32_t vblank_seen;			// Last vblank sequence delivered to this file
+	uint32_t audio_seen;			// Last audio buffer sequence delivered to this file
+	struct mutex alloc_lock;
+	struct list_head allocs;		// Pool allocations owned by this file, released on close
+};
+
+// One SP_IOCTL_ALLOC block from the memory pool, kept alive by its owner and by exported dma-bufs
+struct sp_allocation {
+	struct list_head node;
+	struct kref ref;
+	struct my_driver_data *drvdata;
+	unsigned long paddr;
+	size_t size;
 };
 
+static unsigned int event_poll_us = 500;
+
+static int sp_event_poll_us_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_uint_minmax(val, kp, EVENT_POLL_US_MIN, EVENT_POLL_US_MAX);
+}
+
+static const struct kernel_param_ops sp_event_poll_us_ops = {
+	.set = sp_event_poll_us_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(event_poll_us, &sp_event_poll_us_ops, &event_poll_us, 0644);
+MODULE_PARM_DESC(event_poll_us, "Status register polling interval in microseconds for vblank and audio buffer events, 100 to 100000");
+
+static bool fifo_backpressure;
+module_param(fifo_backpressure, bool, 0444);
+MODULE_PARM_DESC(fifo_backpressure, "Throttle command FIFO writes on the fill level register, off unless the bitstream provides it");
+
+static unsigned int fb_pages = 2;
+module_param(fb_pages, uint, 0444);
+MODULE_PARM_DESC(fb_pages, "Screen pages in the native framebuffer's virtual height, 0 keeps simple-framebuffer");
+
+static bool uio;
+module_param(uio, bool, 0444);
+MODULE_PARM_DESC(uio, "Expose the register blocks and reserved memory through UIO for a userspace driver, leaves ALSA, fbdev and DRM off");
+
 static int		dev_open(struct inode *, struct file *);
 static int		dev_release(struct inode *, struct file *);
 static long		dev_ioctl(struct file *, unsigned int, unsigned long);
 static int		dev_mmap(struct file *file, struct vm_area_struct *vma);
+static ssize_t	dev_read(struct file *, char __user *, size_t, loff_t *);
+static __poll_t	dev_poll(struct file *, poll_table *);
+static enum hrtimer_restart sp_event_timer(struct hrtimer *);
+static int		sp_pcm_init(struct platform_device *, struct my_driver_data *);
+static void		sp_pcm_exit(struct my_driver_data *);
+static void		sp_pcm_buffer_done(struct my_driver_data *);
+static int		sp_fb_init(struct platform_device *, struct my_driver_data *);
+static void		sp_fb_exit(struct my_driver_data *);
+static void		sp_console_scanout(struct my_driver_data *);
+static int		sp_drm_init(struct platform_device *, struct my_driver_data *);
+static void		sp_drm_exit(struct my_driver_data *);
+static void		sp_drm_vblank(struct my_driver_data *);
+static int		sp_uio_init(struct platform_device *, struct my_driver_data *);
+static void		sp_uio_exit(struct my_driver_data *);
+static void		sp_uio_event(struct my_driver_data *);
+static void		sp_free_all(struct my_file_data *);
+static bool		sp_file_owns_range(struct my_file_data *, unsigned long, unsigned long);
+static void		sp_ring_init(struct my_driver_data *);
+static void		sp_ring_reset(struct my_driver_data *);
+static uint32_t	sp_fifo_level(struct my_driver_data *, uint32_t);
+static void		sp_status_init(struct my_driver_data *);
+static void		sp_debugfs_init(struct my_driver_data *);
+static void		sp_uring_events(struct my_driver_data *, bool, bool);
+#if IS_ENABLED(CONFIG_IO_URING)
+static int		dev_uring_cmd(struct io_uring_cmd *, unsigned int);
+#endif
 
 static struct file_operations fops = {
     .owner   = THIS_MODULE,
     .open    = dev_open,
     .unlocked_ioctl = dev_ioctl,
 	.mmap = dev_mmap,
+	.read = dev_read,
+	.poll = dev_poll,
+#if IS_ENABLED(CONFIG_IO_URING)
+	.uring_cmd = dev_uring_cmd,
+#endif
     .release = dev_release,
 };
 
+static volatile uint32_t *sp_block_base(struct my_driver_data *drvdata, uint32_t block)
+{
+	switch (block) {
+		case ERB_Audio:		return drvdata->audio_ctl;
+		case ERB_Video:		return drvdata->video_ctl;
+		case ERB_Palette:	return drvdata->palette_ctl;
+		case ERB_VCP:		return drvdata->vcp_ctl;
+		default:			return NULL;
+	}
+}
+
+static uint32_t sp_mmio_read(struct my_driver_data *drvdata, uint32_t block, uint32_t offset)
+{
+	return ioread32((volatile uint32_t*)(sp_block_base(drvdata, block) + offset));
+}
+
+static void sp_mmio_write(struct my_driver_data *drvdata, uint32_t block, uint32_t offset, uint32_t value)
+{
+	iowrite32(value, (volatile uint32_t*)(sp_block_base(drvdata, block) + offset));
+}
+
+static void sp_mmio_write_rep(struct my_driver_data *drvdata, uint32_t block, const uint32_t *words, uint32_t count)
+{
+	// All words go to the same FIFO address, so no barriers are needed between them
+	iowrite32_rep((void __iomem *)sp_block_base(drvdata, block), words, count);
+}
+
+static const struct sp_reg_ops sp_mmio_reg_ops = {
+	.read = sp_mmio_read,
+	.write = sp_mmio_write,
+	.write_rep = sp_mmio_write_rep,
+};
+
+static inline uint32_t sp_reg_read(struct my_driver_data *drvdata, uint32_t block, uint32_t offset)
+{
+	return drvdata->reg_ops->read(drvdata, block, offset);
+}
+
+// Every word the driver writes to the hardware is traced here, whichever path it comes from
+static inline void sp_reg_write(struct my_driver_data *drvdata, uint32_t block, uint32_t offset, uint32_t value)
+{
+	trace_sandpiper_fifo_write(block, offset, value);
+	drvdata->reg_ops->write(drvdata, block, offset, value);
+}
+
+static inline void sp_reg_write_rep(struct my_driver_data *drvdata, uint32_t block, const uint32_t *words, uint32_t count)
+{
+	if (trace_sandpiper_fifo_write_enabled())
+	{
+		uint32_t i;
+		for (i = 0; i < count; ++i)
+			trace_sandpiper_fifo_write(block, 0, words[i]);
+	}
+	drvdata->reg_ops->write_rep(drvdata, block, words, count);
+}
+
+// Software state shared by probe and the KUnit suite, which runs the driver on a fake register backend
+static void sp_drvdata_init(struct my_driver_data *drvdata, const struct sp_reg_ops *reg_ops)
+{
+	// Reset open file handle count
+	drvdata->open_count = 0;
+	drvdata->reg_ops = reg_ops;
+	mutex_init(&drvdata->fifo_lock);
+	mutex_init(&drvdata->event_users_lock);
+	spin_lock_init(&drvdata->event_lock);
+	spin_lock_init(&drvdata->pcm_lock);
+	init_waitqueue_head(&drvdata->event_wait);
+	INIT_LIST_HEAD(&drvdata->uring_waiters);
+	hrtimer_init(&drvdata->event_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	drvdata->event_timer.function = sp_event_timer;
+}
+
 static int sandpiper_probe(struct platform_device *pdev)
 {
     struct my_driver_data *drvdata;
@@ -142,8 +664,7 @@ static int sandpiper_probe(struct platform_device *pdev)
         return -ENOMEM;
 	}
 
-	// Reset open file handle count
-	drvdata->open_count = 0;
+	sp_drvdata_init(drvdata, &sp_mmio_reg_ops);
 
 	drvdata->audio_ctl = ioremap(AUDIO_CTRL_REGS_ADDR, DEVICE_MEMORY_SIZE);
 	if (!drvdata->audio_ctl) {
@@ -169,6 +690,15 @@ static int sandpiper_probe(struct platform_device *pdev)
 		return -ENOMEM;
 	}
 
+	drvdata->shared_mem = memremap(PHYS_ADDR, RESERVED_MEMORY_SIZE, MEMREMAP_WB);
+	if (!drvdata->shared_mem) {
+		printk(KERN_INFO "%s: failed to map shared memory region\n", DEVICE_NAME);
+		return -ENOMEM;
+	}
+
+	sp_ring_init(drvdata);
+	sp_status_init(drvdata);
+
     ret = alloc_chrdev_region(&dev_num, 0, 1, DEVICE_NAME);
     if (ret < 0) {
         printk(KERN_INFO "%s: failed to allocate character device region\n", DEVICE_NAME);
@@ -198,12 +728,41 @@ static int sandpiper_probe(struct platform_device *pdev)
 
     platform_set_drvdata(pdev, drvdata);
 
-    printk(KERN_INFO "%s: audio control registers at 0x%x\n", DEVICE_NAME, (uint32_t)drvdata->audio_ctl);
-    printk(KERN_INFO "%s: video control registers at 0x%x\n", DEVICE_NAME, (uint32_t)drvdata->video_ctl);
-	printk(KERN_INFO "%s: palette registers at 0x%x\n", DEVICE_NAME, (uint32_t)drvdata->palette_ctl);
-	printk(KERN_INFO "%s: VCP control registers at 0x%x\n", DEVICE_NAME, (uint32_t)drvdata->vcp_ctl);
+    printk(KERN_INFO "%s: audio control registers at 0x%x\n", DEVICE_NAME, (uint32_t)(uintptr_t)drvdata->audio_ctl);
+    printk(KERN_INFO "%s: video control registers at 0x%x\n", DEVICE_NAME, (uint32_t)(uintptr_t)drvdata->video_ctl);
+	printk(KERN_INFO "%s: palette registers at 0x%x\n", DEVICE_NAME, (uint32_t)(uintptr_t)drvdata->palette_ctl);
+	printk(KERN_INFO "%s: VCP control registers at 0x%x\n", DEVICE_NAME, (uint32_t)(uintptr_t)drvdata->vcp_ctl);
 	printk(KERN_INFO "%s: character device /dev/%s created\n", DEVICE_NAME, DEVICE_NAME);
 
+	// A userspace driver owns the command FIFOs, so none of the kernel side users that write them are started
+	if (uio)
+	{
+		if (sp_uio_init(pdev, drvdata) < 0)
+			printk(KERN_INFO "%s: failed to register UIO device\n", DEVICE_NAME);
+		sp_debugfs_init(drvdata);
+		return 0;
+	}
+
+	// Audio stays usable through the ioctl interface if the sound card can't be created
+	if (sp_pcm_init(pdev, drvdata) < 0)
+		printk(KERN_INFO "%s: failed to register ALSA card\n", DEVICE_NAME);
+
+	drvdata->mem_pool = devm_gen_pool_create(&pdev->dev, PAGE_SHIFT, -1, DEVICE_NAME);
+	if (IS_ERR(drvdata->mem_pool) || gen_pool_add(drvdata->mem_pool, POOL_MEMORY_ADDR, POOL_MEMORY_SIZE, -1) < 0) {
+		printk(KERN_INFO "%s: failed to create memory pool\n", DEVICE_NAME);
+		drvdata->mem_pool = NULL;
+	}
+
+	// The console stays on simple-framebuffer if the native framebuffer can't be set up
+	if (drvdata->mem_pool && sp_fb_init(pdev, drvdata) < 0)
+		printk(KERN_INFO "%s: failed to register framebuffer\n", DEVICE_NAME);
+
+	// Likewise the display stays usable through the console framebuffer and ioctls without DRM
+	if (drvdata->mem_pool && sp_drm_init(pdev, drvdata) < 0)
+		printk(KERN_INFO "%s: failed to register DRM device\n", DEVICE_NAME);
+
+	sp_debugfs_init(drvdata);
+
     return 0;
 }
 
@@ -211,6 +770,14 @@ static void sandpiper_remove(struct platform_device *pdev)
 {
     struct my_driver_data *drvdata = platform_get_drvdata(pdev);
 
+	debugfs_remove_recursive(drvdata->debugfs);
+	sp_uio_exit(drvdata);
+	sp_drm_exit(drvdata);
+	sp_fb_exit(drvdata);
+	sp_pcm_exit(drvdata);
+	hrtimer_cancel(&drvdata->event_timer);
+	cancel_work_sync(&drvdata->ring_work);
+
     device_destroy(class_create(DEVICE_NAME), MKDEV(MAJOR(drvdata->cdev.dev), MINOR(drvdata->cdev.dev)));
     class_destroy(class_create(DEVICE_NAME));
 
@@ -218,6 +785,7 @@ static void sandpiper_remove(struct platform_device *pdev)
 	iounmap(drvdata->audio_ctl);
 	iounmap(drvdata->palette_ctl);
 	iounmap(drvdata->vcp_ctl);
+	memunmap(drvdata->shared_mem);
 
     cdev_del(&drvdata->cdev);
     unregister_chrdev_region(drvdata->cdev.dev, 1);
@@ -225,186 +793,2773 @@ static void sandpiper_remove(struct platform_device *pdev)
     printk(KERN_INFO "%s: control registers unmapped and character device removed\n", DEVICE_NAME);
 }
 
-static int dev_open(struct inode *inode, struct file *file)
+static struct SPStatusPage *sp_status_page(struct my_driver_data *drvdata)
 {
-    struct my_driver_data *drvdata = container_of(inode->i_cdev, struct my_driver_data, cdev);
-    file->private_data = drvdata;
-
-	// Inc reference count
-	drvdata->open_count++;
+	return drvdata->shared_mem + (STATUS_PAGE_ADDR - PHYS_ADDR);
+}
 
-	return 0;
+static void sp_status_init(struct my_driver_data *drvdata)
+{
+	memset(sp_status_page(drvdata), 0, PAGE_SIZE);
 }
 
-static int dev_release(struct inode *inode, struct file *file)
+// Called from the event timer with event_lock held, so there is a single writer
+static void sp_status_update(struct my_driver_data *drvdata, bool vblank_done)
 {
-	struct my_driver_data *drvdata = container_of(inode->i_cdev, struct my_driver_data, cdev);
+	struct SPStatusPage *status = sp_status_page(drvdata);
+	uint64_t video_bytes = atomic64_read(&drvdata->fifo_bytes[ERB_Video]);
+	uint32_t sequence = status->sequence;
 
-	// Decrement reference count
-	drvdata->open_count--;
+	WRITE_ONCE(status->sequence, sequence + 1);
+	smp_wmb();
 
-	// Tear down device states
-	// This should allow us to restore device state without having to install signal handlers in user space
-	if (drvdata->open_count == 0)
+	// The VPU latches queued commands at vblank, so new video traffic since the last one means a swap just happened
+	if (vblank_done && video_bytes != drvdata->status_video_bytes)
 	{
-		// VPU
-		{
-			// Set video mode to 640x480x16 RGB and scanout pointing at linux framebuffer
-			uint32_t modeflags = MAKEVMODEINFO((uint32_t)ECM_16bit_RGB, (uint32_t)EVM_640_Wide, (uint32_t)EVS_Enable);
-			iowrite32(VPUCMD_SETVPAGE, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(0x18000000, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(VPUCMD_SETVMODE, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(modeflags, (volatile uint32_t*)(drvdata->video_ctl));
+		drvdata->status_video_bytes = video_bytes;
+		status->swap_sequence++;
+		status->swap_time = ktime_to_ns(drvdata->vblank_time);
+	}
 
-			// Reset VPU control registers
-			iowrite32(VPUCMD_WCONTROLREG | 0, (volatile uint32_t*)(drvdata->video_ctl));
+	status->vblank_count = drvdata->vblank_status;
+	status->vblank_sequence = drvdata->vblank_sequence;
+	status->vblank_time = ktime_to_ns(drvdata->vblank_time);
+	status->audio_count = drvdata->audio_status;
+	status->audio_sequence = drvdata->audio_sequence;
+	status->audio_time = ktime_to_ns(drvdata->audio_time);
+	status->fifo_level[ERB_Audio] = sp_fifo_level(drvdata, ERB_Audio);
+	status->fifo_level[ERB_Video] = sp_fifo_level(drvdata, ERB_Video);
+	status->fifo_level[ERB_VCP] = sp_fifo_level(drvdata, ERB_VCP);
+	status->vcp_status = sp_reg_read(drvdata, ERB_VCP, VCP_STATUS_OFFSET);
+	status->vcp_slot = READ_ONCE(drvdata->vcp_slot);
+	status->update_time = ktime_get_ns();
+
+	smp_wmb();
+	WRITE_ONCE(status->sequence, sequence + 2);
+}
 
-			// Reset video scroll registers
-			iowrite32(VPUCMD_SHIFTCACHE, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(0, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(VPUCMD_SHIFTSCANOUT, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(0, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(VPUCMD_SHIFTPIXEL, (volatile uint32_t*)(drvdata->video_ctl));
-			iowrite32(0, (volatile uint32_t*)(drvdata->video_ctl));
-		}
+static enum hrtimer_restart sp_event_timer(struct hrtimer *timer)
+{
+	struct my_driver_data *drvdata = container_of(timer, struct my_driver_data, event_timer);
+	uint32_t vblank = sp_reg_read(drvdata, ERB_Video, VIDEO_STATUS_OFFSET);
+	uint32_t audio = sp_reg_read(drvdata, ERB_Audio, AUDIO_STATUS_OFFSET);
+	bool vblank_done = false;
+	bool audio_done = false;
+	unsigned long index;
+
+	spin_lock(&drvdata->event_lock);
+	if (vblank != drvdata->vblank_status)
+	{
+		drvdata->vblank_status = vblank;
+		drvdata->vblank_sequence++;
+		drvdata->vblank_time = ktime_get();
+		vblank_done = true;
+
+		// Latch staged palette entries while the beam is outside the visible area
+		for_each_set_bit(index, drvdata->palette_dirty, PALETTE_ENTRIES)
+			sp_reg_write(drvdata, ERB_Palette, index, drvdata->palette_staged[index]);
+		bitmap_zero(drvdata->palette_dirty, PALETTE_ENTRIES);
+	}
+	if (audio != drvdata->audio_status)
+	{
+		drvdata->audio_status = audio;
+		drvdata->audio_sequence++;
+		drvdata->audio_time = ktime_get();
+		audio_done = true;
+	}
+	sp_status_update(drvdata, vblank_done);
+	spin_unlock(&drvdata->event_lock);
 
-		// APU
-		{
-			// Stop all audio channels
-			iowrite32(APUCMD_SETRATE, (volatile uint32_t*)(drvdata->audio_ctl));
-			iowrite32(ASR_Halt, (volatile uint32_t*)(drvdata->audio_ctl));
-		}
+	if (audio_done)
+		sp_pcm_buffer_done(drvdata);
+	if (vblank_done)
+		sp_drm_vblank(drvdata);
 
-		// VCP
-		{
-			// Stop all VCP program activity
-			iowrite32(VCPEXEC | 0, (volatile uint32_t*)(drvdata->vcp_ctl));
-		}
+	if (vblank_done || audio_done)
+	{
+		wake_up_interruptible(&drvdata->event_wait);
+		sp_uring_events(drvdata, vblank_done, audio_done);
+		sp_uio_event(drvdata);
 	}
 
-	return 0;
+	hrtimer_forward_now(timer, us_to_ktime(event_poll_us));
+	return HRTIMER_RESTART;
 }
 
-static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+// The event timer only runs while it has users, callers hold event_users_lock
+static void sp_event_timer_get(struct my_driver_data *drvdata)
 {
-    struct my_driver_data *drvdata = (struct my_driver_data*)file->private_data;
-
-	struct SPIoctl ioctl_data;
-	// Copy data from user space
-	copy_from_user(&ioctl_data, (void __user *)arg, sizeof(ioctl_data));
-
-    switch (cmd) {
-        case SP_IOCTL_GET_VIDEO_CTL:
-		{
-			ioctl_data.value = drvdata->video_ctl;
-		}
-		break;
+	unsigned long flags;
 
-		case SP_IOCTL_GET_AUDIO_CTL:
-		{
-			ioctl_data.value = drvdata->audio_ctl;
-		}
-		break;
+	if (drvdata->event_users++ == 0)
+	{
+		spin_lock_irqsave(&drvdata->event_lock, flags);
+		drvdata->vblank_status = sp_reg_read(drvdata, ERB_Video, VIDEO_STATUS_OFFSET);
+		drvdata->audio_status = sp_reg_read(drvdata, ERB_Audio, AUDIO_STATUS_OFFSET);
+		spin_unlock_irqrestore(&drvdata->event_lock, flags);
+		hrtimer_start(&drvdata->event_timer, us_to_ktime(event_poll_us), HRTIMER_MODE_REL);
+	}
+}
 
-		case SP_IOCTL_GET_PALETTE_CTL:
-		{
-			ioctl_data.value = drvdata->palette_ctl;
-		}
-		break;
+static void sp_event_timer_put(struct my_driver_data *drvdata)
+{
+	if (--drvdata->event_users == 0)
+		hrtimer_cancel(&drvdata->event_timer);
+}
 
-		case SP_IOCTL_GET_VCP_CTL:
-		{
-			ioctl_data.value = drvdata->vcp_ctl;
-		}
-		break;
+// Start watching for events on behalf of this file
+static void sp_events_enable(struct my_file_data *filedata)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
 
-		case SP_IOCTL_AUDIO_READ:
-		{
-			ioctl_data.value = ioread32((volatile uint32_t*)(drvdata->audio_ctl + ioctl_data.offset));
-		}
-		break;
+	if (READ_ONCE(filedata->events_enabled))
+		return;
 
-		case SP_IOCTL_AUDIO_WRITE:
-		{
-			iowrite32(ioctl_data.value, (volatile uint32_t*)(drvdata->audio_ctl + ioctl_data.offset));
-		}
-		break;
+	mutex_lock(&drvdata->event_users_lock);
+	if (!filedata->events_enabled)
+	{
+		unsigned long flags;
 
-		case SP_IOCTL_VIDEO_READ:
-		{
-			ioctl_data.value = ioread32((volatile uint32_t*)(drvdata->video_ctl + ioctl_data.offset));
-		}
-		break;
+		sp_event_timer_get(drvdata);
 
-		case SP_IOCTL_VIDEO_WRITE:
-		{
-			iowrite32(ioctl_data.value, (volatile uint32_t*)(drvdata->video_ctl + ioctl_data.offset));
-		}
-		break;
+		// Only events that happen from now on are delivered
+		spin_lock_irqsave(&drvdata->event_lock, flags);
+		filedata->vblank_seen = drvdata->vblank_sequence;
+		filedata->audio_seen = drvdata->audio_sequence;
+		spin_unlock_irqrestore(&drvdata->event_lock, flags);
 
-		case SP_IOCTL_PALETTE_READ:
-		{
-			ioctl_data.value = ioread32((volatile uint32_t*)(drvdata->palette_ctl + ioctl_data.offset));
-		}
-		break;
+		WRITE_ONCE(filedata->events_enabled, true);
+	}
+	mutex_unlock(&drvdata->event_users_lock);
+}
 
-		case SP_IOCTL_PALETTE_WRITE:
-		{
-			iowrite32(ioctl_data.value, (volatile uint32_t*)(drvdata->palette_ctl + ioctl_data.offset));
-		}
-		break;
+static void sp_events_disable(struct my_file_data *filedata)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
 
-		case SP_IOCTL_VCP_READ:
-		{
-			ioctl_data.value = ioread32((volatile uint32_t*)(drvdata->vcp_ctl + ioctl_data.offset));
-		}
-		break;
+	mutex_lock(&drvdata->event_users_lock);
+	if (filedata->events_enabled)
+	{
+		filedata->events_enabled = false;
+		sp_event_timer_put(drvdata);
+	}
+	mutex_unlock(&drvdata->event_users_lock);
+}
 
-		case SP_IOCTL_VCP_WRITE:
-		{
-			iowrite32(ioctl_data.value, (volatile uint32_t*)(drvdata->vcp_ctl + ioctl_data.offset));
-		}
-		break;
+static void sp_events_set_mask(struct my_file_data *filedata, uint32_t mask)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
+	uint32_t enabled = mask & ~filedata->event_mask;
+	unsigned long flags;
+
+	// Newly enabled event types start from the current state rather than replaying old events
+	spin_lock_irqsave(&drvdata->event_lock, flags);
+	if (enabled & EVENT_MASK(EET_VBlank))
+		filedata->vblank_seen = drvdata->vblank_sequence;
+	if (enabled & EVENT_MASK(EET_AudioBuffer))
+		filedata->audio_seen = drvdata->audio_sequence;
+	WRITE_ONCE(filedata->event_mask, mask);
+	spin_unlock_irqrestore(&drvdata->event_lock, flags);
+
+	// Wake any reader that is now waiting for nothing, or for something that already happened
+	wake_up_interruptible(&drvdata->event_wait);
+}
 
-		default:
-            return -ENOTTY;
-    }
+static bool sp_events_pending(struct my_file_data *filedata)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
+	uint32_t mask = READ_ONCE(filedata->event_mask);
 
-	// Copy the ioctl_data structure back to user space
-	copy_to_user((void __user *)arg, &ioctl_data, sizeof(ioctl_data));
+	if ((mask & EVENT_MASK(EET_VBlank)) && READ_ONCE(drvdata->vblank_sequence) != READ_ONCE(filedata->vblank_seen))
+		return true;
+	if ((mask & EVENT_MASK(EET_AudioBuffer)) && READ_ONCE(drvdata->audio_sequence) != READ_ONCE(filedata->audio_seen))
+		return true;
 
-    return 0;
+	return false;
 }
 
-static int dev_mmap(struct file *file, struct vm_area_struct *vma)
+// Gather the events this file has not seen yet, returns the number of events written
+static size_t sp_events_collect(struct my_file_data *filedata, struct SPEvent *events, size_t max_events)
 {
-	//struct my_driver_data *drvdata = (struct my_driver_data*)file->private_data;
-	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-	unsigned long physical_addr = 0;
+	struct my_driver_data *drvdata = filedata->drvdata;
+	unsigned long flags;
+	size_t count = 0;
 
-	if (offset == PHYS_ADDR)
+	spin_lock_irqsave(&drvdata->event_lock, flags);
+	if (count < max_events && (filedata->event_mask & EVENT_MASK(EET_AudioBuffer)) && drvdata->audio_sequence != filedata->audio_seen)
 	{
-		physical_addr = PHYS_ADDR;
-		if (size > RESERVED_MEMORY_SIZE)
-		{
-			printk(KERN_INFO "%s: mmap request exceeds memory region\n", DEVICE_NAME);
-			return -EINVAL;
-		}
+		// Audio goes first so a short read never starves the latency sensitive event
+		events[count].type = EET_AudioBuffer;
+		events[count].sequence = drvdata->audio_sequence;
+		events[count].timestamp = ktime_to_ns(drvdata->audio_time);
+		events[count].value = drvdata->audio_status;
+		events[count].reserved = 0;
+		filedata->audio_seen = drvdata->audio_sequence;
+		count++;
 	}
-	else
+	if (count < max_events && (filedata->event_mask & EVENT_MASK(EET_VBlank)) && drvdata->vblank_sequence != filedata->vblank_seen)
 	{
-		printk(KERN_INFO "%s: invalid mmap offset 0x%lx\n", DEVICE_NAME, offset);
-		return -EINVAL;
+		// Missed vblanks are coalesced into the latest one, the sequence number tells how many were skipped
+		events[count].type = EET_VBlank;
+		events[count].sequence = drvdata->vblank_sequence;
+		events[count].timestamp = ktime_to_ns(drvdata->vblank_time);
+		events[count].value = drvdata->vblank_status;
+		events[count].reserved = 0;
+		filedata->vblank_seen = drvdata->vblank_sequence;
+		count++;
 	}
+	spin_unlock_irqrestore(&drvdata->event_lock, flags);
 
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	return count;
+}
 
-	if (remap_pfn_range(vma, vma->vm_start, physical_addr >> PAGE_SHIFT, size, vma->vm_page_prot))
-	{
-		printk(KERN_INFO "%s: failed to remap page\n", DEVICE_NAME);
-		return -EAGAIN;
+static ssize_t dev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct my_file_data *filedata = (struct my_file_data*)file->private_data;
+	struct my_driver_data *drvdata = filedata->drvdata;
+	struct SPEvent events[EET_Count];
+	size_t num_events;
+
+	if (count < sizeof(struct SPEvent))
+		return -EINVAL;
+
+	sp_events_enable(filedata);
+
+	do
+	{
+		if (!sp_events_pending(filedata))
+		{
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (wait_event_interruptible(drvdata->event_wait, sp_events_pending(filedata)))
+				return -ERESTARTSYS;
+		}
+
+		// Another reader sharing this file may have taken the events first
+		num_events = sp_events_collect(filedata, events, min_t(size_t, count / sizeof(struct SPEvent), EET_Count));
+	} while (num_events == 0);
+
+	if (copy_to_user(buf, events, num_events * sizeof(struct SPEvent)))
+		return -EFAULT;
+
+	return num_events * sizeof(struct SPEvent);
+}
+
+static __poll_t dev_poll(struct file *file, poll_table *wait)
+{
+	struct my_file_data *filedata = (struct my_file_data*)file->private_data;
+
+	sp_events_enable(filedata);
+	poll_wait(file, &filedata->drvdata->event_wait, wait);
+
+	return sp_events_pending(filedata) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+#if IS_REACHABLE(CONFIG_SND_PCM)
+
+static const struct snd_pcm_hardware sp_pcm_hardware = {
+	.info				= SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID | SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER,
+	.formats			= SNDRV_PCM_FMTBIT_S16_LE,
+	.rates				= SNDRV_PCM_RATE_11025 | SNDRV_PCM_RATE_22050 | SNDRV_PCM_RATE_44100,
+	.rate_min			= 11025,
+	.rate_max			= 44100,
+	.channels_min		= 2,
+	.channels_max		= 2,
+	.buffer_bytes_max	= PCM_BUFFER_SIZE,
+	.period_bytes_min	= PCM_PERIOD_BYTES_MIN,
+	.period_bytes_max	= PCM_PERIOD_BYTES_MAX,
+	.periods_min		= 2,
+	.periods_max		= PCM_BUFFER_SIZE / PCM_PERIOD_BYTES_MIN,
+};
+
+static uint32_t sp_pcm_rate(unsigned int rate)
+{
+	switch (rate) {
+		case 11025:	return ASR_11_025_Hz;
+		case 22050:	return ASR_22_050_Hz;
+		default:	return ASR_44_100_Hz;
+	}
+}
+
+// Hand one period of the ring buffer to the APU, callers hold pcm_lock
+static void sp_pcm_queue_period(struct my_driver_data *drvdata, uint32_t period)
+{
+	sp_reg_write(drvdata, ERB_Audio, 0, APUCMD_START);
+	sp_reg_write(drvdata, ERB_Audio, 0, PCM_BUFFER_ADDR + period * drvdata->pcm_period_bytes);
+}
+
+// Called from the event timer each time the APU finishes a buffer
+// The APU already holds the period after the one that finished, so only the one after that needs queueing
+static void sp_pcm_buffer_done(struct my_driver_data *drvdata)
+{
+	struct snd_pcm_substream *substream = NULL;
+
+	spin_lock(&drvdata->pcm_lock);
+	if (drvdata->pcm_running)
+	{
+		drvdata->pcm_playing = (drvdata->pcm_playing + 1) % drvdata->pcm_periods;
+		sp_pcm_queue_period(drvdata, (drvdata->pcm_playing + 1) % drvdata->pcm_periods);
+		substream = drvdata->pcm_substream;
+	}
+	spin_unlock(&drvdata->pcm_lock);
+
+	if (substream)
+		snd_pcm_period_elapsed(substream);
+}
+
+static int sp_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct my_driver_data *drvdata = snd_pcm_substream_chip(substream);
+	int ret;
+
+	substream->runtime->hw = sp_pcm_hardware;
+	ret = snd_pcm_hw_constraint_integer(substream->runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+	if (ret < 0)
+		return ret;
+
+	WRITE_ONCE(drvdata->pcm_substream, substream);
+
+	// Buffer completion is detected by the event timer
+	mutex_lock(&drvdata->event_users_lock);
+	sp_event_timer_get(drvdata);
+	mutex_unlock(&drvdata->event_users_lock);
+
+	return 0;
+}
+
+static int sp_pcm_close(struct snd_pcm_substream *substream)
+{
+	struct my_driver_data *drvdata = snd_pcm_substream_chip(substream);
+
+	mutex_lock(&drvdata->event_users_lock);
+	sp_event_timer_put(drvdata);
+	mutex_unlock(&drvdata->event_users_lock);
+
+	WRITE_ONCE(drvdata->pcm_substream, NULL);
+
+	return 0;
+}
+
+static int sp_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *params)
+{
+	struct my_driver_data *drvdata = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	// The ring buffer is a fixed slice of the reserved memory
+	runtime->dma_area = drvdata->pcm_buffer;
+	runtime->dma_addr = PCM_BUFFER_ADDR;
+	runtime->dma_bytes = params_buffer_bytes(params);
+
+	return 0;
+}
+
+static int sp_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct my_driver_data *drvdata = snd_pcm_substream_chip(substream);
+	unsigned long flags;
+
+	spin_lock_irqsave(&drvdata->pcm_lock, flags);
+	drvdata->pcm_period_bytes = snd_pcm_lib_period_bytes(substream);
+	drvdata->pcm_periods = substream->runtime->periods;
+	drvdata->pcm_playing = 0;
+	spin_unlock_irqrestore(&drvdata->pcm_lock, flags);
+
+	return 0;
+}
+
+static int sp_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct my_driver_data *drvdata = snd_pcm_substream_chip(substream);
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&drvdata->pcm_lock, flags);
+	switch (cmd) {
+		case SNDRV_PCM_TRIGGER_START:
+		{
+			// APU buffer size is in 32 bit words, one stereo S16 frame each
+			sp_reg_write(drvdata, ERB_Audio, 0, APUCMD_BUFFERSIZE);
+			sp_reg_write(drvdata, ERB_Audio, 0, drvdata->pcm_period_bytes / sizeof(uint32_t));
+			sp_reg_write(drvdata, ERB_Audio, 0, APUCMD_SETRATE);
+			sp_reg_write(drvdata, ERB_Audio, 0, sp_pcm_rate(substream->runtime->rate));
+
+			// Keep one period queued behind the playing one so the APU never waits on the event timer
+			sp_pcm_queue_period(drvdata, drvdata->pcm_playing);
+			sp_pcm_queue_period(drvdata, (drvdata->pcm_playing + 1) % drvdata->pcm_periods);
+			WRITE_ONCE(drvdata->pcm_running, true);
+		}
+		break;
+
+		case SNDRV_PCM_TRIGGER_STOP:
+		{
+			sp_reg_write(drvdata, ERB_Audio, 0, APUCMD_SETRATE);
+			sp_reg_write(drvdata, ERB_Audio, 0, ASR_Halt);
+			WRITE_ONCE(drvdata->pcm_running, false);
+		}
+		break;
+
+		default:
+			ret = -EINVAL;
+	}
+	spin_unlock_irqrestore(&drvdata->pcm_lock, flags);
+
+	return ret;
+}
+
+static snd_pcm_uframes_t sp_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct my_driver_data *drvdata = snd_pcm_substream_chip(substream);
+
+	return bytes_to_frames(substream->runtime, READ_ONCE(drvdata->pcm_playing) * drvdata->pcm_period_bytes);
+}
+
+static int sp_pcm_mmap(struct snd_pcm_substream *substream, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (size > PCM_BUFFER_SIZE)
+		return -EINVAL;
+
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	return remap_pfn_range(vma, vma->vm_start, PCM_BUFFER_ADDR >> PAGE_SHIFT, size, vma->vm_page_prot);
+}
+
+static const struct snd_pcm_ops sp_pcm_ops = {
+	.open		= sp_pcm_open,
+	.close		= sp_pcm_close,
+	.hw_params	= sp_pcm_hw_params,
+	.prepare	= sp_pcm_prepare,
+	.trigger	= sp_pcm_trigger,
+	.pointer	= sp_pcm_pointer,
+	.mmap		= sp_pcm_mmap,
+};
+
+static int sp_pcm_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	struct snd_pcm *pcm;
+	int ret;
+
+	drvdata->pcm_buffer = memremap(PCM_BUFFER_ADDR, PCM_BUFFER_SIZE, MEMREMAP_WC);
+	if (!drvdata->pcm_buffer)
+		return -ENOMEM;
+
+	ret = snd_card_new(&pdev->dev, SNDRV_DEFAULT_IDX1, SNDRV_DEFAULT_STR1, THIS_MODULE, 0, &drvdata->card);
+	if (ret < 0)
+		goto fail_unmap;
+
+	strscpy(drvdata->card->driver, DEVICE_NAME, sizeof(drvdata->card->driver));
+	strscpy(drvdata->card->shortname, "Sandpiper APU", sizeof(drvdata->card->shortname));
+	strscpy(drvdata->card->longname, "Sandpiper APU", sizeof(drvdata->card->longname));
+
+	ret = snd_pcm_new(drvdata->card, DEVICE_NAME, 0, 1, 0, &pcm);
+	if (ret < 0)
+		goto fail_card;
+
+	pcm->private_data = drvdata;
+	strscpy(pcm->name, "Sandpiper APU", sizeof(pcm->name));
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &sp_pcm_ops);
+
+	ret = snd_card_register(drvdata->card);
+	if (ret < 0)
+		goto fail_card;
+
+	printk(KERN_INFO "%s: ALSA playback buffer at 0x%x\n", DEVICE_NAME, PCM_BUFFER_ADDR);
+
+	return 0;
+
+fail_card:
+	snd_card_free(drvdata->card);
+	drvdata->card = NULL;
+fail_unmap:
+	memunmap(drvdata->pcm_buffer);
+	drvdata->pcm_buffer = NULL;
+	return ret;
+}
+
+static void sp_pcm_exit(struct my_driver_data *drvdata)
+{
+	if (drvdata->card)
+		snd_card_free(drvdata->card);
+	if (drvdata->pcm_buffer)
+		memunmap(drvdata->pcm_buffer);
+}
+
+#else
+
+static int sp_pcm_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	return 0;
+}
+
+static void sp_pcm_exit(struct my_driver_data *drvdata)
+{
+}
+
+static void sp_pcm_buffer_done(struct my_driver_data *drvdata)
+{
+}
+
+#endif
+
+#if IS_REACHABLE(CONFIG_FB)
+
+struct sp_fb {
+	struct my_driver_data *drvdata;
+	unsigned long paddr;			// Physical address of the first screen page
+	size_t size;					// Bytes reserved for all screen pages
+	uint32_t pseudo_palette[16];	// Console colors in 16 bit mode
+	struct work_struct pan_work;	// Applies pans outside of atomic console context
+};
+
+// The console only drives the VPU while nobody else has the device open
+static bool sp_fb_owns_display(struct my_driver_data *drvdata)
+{
+	return READ_ONCE(drvdata->open_count) == 0 && !READ_ONCE(drvdata->drm_active);
+}
+
+static uint32_t sp_fb_vmode(struct fb_var_screeninfo *var)
+{
+	uint32_t cmode = var->bits_per_pixel == 8 ? ECM_8bit_Indexed : ECM_16bit_RGB;
+	uint32_t vmode = var->xres == 320 ? EVM_320_Wide : EVM_640_Wide;
+
+	return MAKEVMODEINFO(cmode, vmode, (uint32_t)EVS_Enable);
+}
+
+static uint32_t sp_fb_page(struct fb_info *info)
+{
+	struct sp_fb *spfb = info->par;
+
+	return spfb->paddr + info->var.yoffset * info->fix.line_length;
+}
+
+static void sp_fb_pan_work(struct work_struct *work)
+{
+	struct sp_fb *spfb = container_of(work, struct sp_fb, pan_work);
+	struct my_driver_data *drvdata = spfb->drvdata;
+
+	mutex_lock(&drvdata->fifo_lock);
+	if (sp_fb_owns_display(drvdata))
+	{
+		sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVPAGE);
+		sp_reg_write(drvdata, ERB_Video, 0, sp_fb_page(drvdata->fb_info));
+		atomic64_add(2 * sizeof(uint32_t), &drvdata->fifo_bytes[ERB_Video]);
+	}
+	mutex_unlock(&drvdata->fifo_lock);
+}
+
+static int sp_fb_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
+{
+	struct sp_fb *spfb = info->par;
+	uint32_t line_length, pages;
+
+	if (var->bits_per_pixel != 8 && var->bits_per_pixel != 16)
+		return -EINVAL;
+	if (!(var->xres == 640 && var->yres == 480) && !(var->xres == 320 && var->yres == 240))
+		return -EINVAL;
+
+	// Virtual height is always a whole number of screens that fits the allocation
+	line_length = var->xres * var->bits_per_pixel / 8;
+	pages = min_t(uint32_t, max(var->yres_virtual, var->yres) / var->yres, spfb->size / (line_length * var->yres));
+	if (pages == 0)
+		return -ENOMEM;
+
+	var->xres_virtual = var->xres;
+	var->yres_virtual = pages * var->yres;
+	var->xoffset = 0;
+	if (var->yoffset + var->yres > var->yres_virtual)
+		var->yoffset = 0;
+
+	if (var->bits_per_pixel == 16)
+	{
+		var->red = (struct fb_bitfield){ 11, 5, 0 };
+		var->green = (struct fb_bitfield){ 5, 6, 0 };
+		var->blue = (struct fb_bitfield){ 0, 5, 0 };
+	}
+	else
+	{
+		var->red = (struct fb_bitfield){ 0, 8, 0 };
+		var->green = (struct fb_bitfield){ 0, 8, 0 };
+		var->blue = (struct fb_bitfield){ 0, 8, 0 };
+	}
+	var->transp = (struct fb_bitfield){ 0, 0, 0 };
+
+	return 0;
+}
+
+static int sp_fb_set_par(struct fb_info *info)
+{
+	struct sp_fb *spfb = info->par;
+	struct my_driver_data *drvdata = spfb->drvdata;
+
+	info->fix.line_length = info->var.xres * info->var.bits_per_pixel / 8;
+	info->fix.visual = info->var.bits_per_pixel == 8 ? FB_VISUAL_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
+
+	mutex_lock(&drvdata->fifo_lock);
+	if (sp_fb_owns_display(drvdata))
+		sp_console_scanout(drvdata);
+	mutex_unlock(&drvdata->fifo_lock);
+
+	return 0;
+}
+
+// Scrolling the console is a page pointer change instead of a copy
+static int sp_fb_pan_display(struct fb_var_screeninfo *var, struct fb_info *info)
+{
+	struct sp_fb *spfb = info->par;
+
+	// fbcon pans from atomic context, the FIFO lock is taken by the worker
+	info->var.yoffset = var->yoffset;
+	schedule_work(&spfb->pan_work);
+
+	return 0;
+}
+
+static void sp_fb_write_palette(struct my_driver_data *drvdata, uint32_t index, uint16_t red, uint16_t green, uint16_t blue)
+{
+	sp_reg_write(drvdata, ERB_Palette, index, ((red >> 8) << 16) | ((green >> 8) << 8) | (blue >> 8));
+}
+
+static int sp_fb_setcolreg(unsigned regno, unsigned red, unsigned green, unsigned blue, unsigned transp, struct fb_info *info)
+{
+	struct sp_fb *spfb = info->par;
+
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR)
+	{
+		if (regno >= 16)
+			return -EINVAL;
+		spfb->pseudo_palette[regno] = ((red >> 11) << 11) | ((green >> 10) << 5) | (blue >> 11);
+		return 0;
+	}
+
+	if (regno >= 256)
+		return -EINVAL;
+	if (sp_fb_owns_display(spfb->drvdata))
+		sp_fb_write_palette(spfb->drvdata, regno, red, green, blue);
+
+	return 0;
+}
+
+static int sp_fb_setcmap(struct fb_cmap *cmap, struct fb_info *info)
+{
+	struct sp_fb *spfb = info->par;
+	uint32_t i;
+
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR)
+	{
+		for (i = 0; i < cmap->len; ++i)
+			sp_fb_setcolreg(cmap->start + i, cmap->red[i], cmap->green[i], cmap->blue[i], 0, info);
+		return 0;
+	}
+
+	if (cmap->start + cmap->len > 256)
+		return -EINVAL;
+
+	// Whole table goes straight to the palette block
+	if (sp_fb_owns_display(spfb->drvdata))
+		for (i = 0; i < cmap->len; ++i)
+			sp_fb_write_palette(spfb->drvdata, cmap->start + i, cmap->red[i], cmap->green[i], cmap->blue[i]);
+
+	return 0;
+}
+
+static const struct fb_ops sp_fb_ops = {
+	.owner			= THIS_MODULE,
+	FB_DEFAULT_IOMEM_OPS,
+	.fb_check_var	= sp_fb_check_var,
+	.fb_set_par		= sp_fb_set_par,
+	.fb_pan_display	= sp_fb_pan_display,
+	.fb_setcolreg	= sp_fb_setcolreg,
+	.fb_setcmap		= sp_fb_setcmap,
+};
+
+static void sp_fb_get_scanout(struct my_driver_data *drvdata, uint32_t *vmode, uint32_t *page)
+{
+	if (!drvdata->fb_info)
+		return;
+
+	*vmode = sp_fb_vmode(&drvdata->fb_info->var);
+	*page = sp_fb_page(drvdata->fb_info);
+}
+
+static int sp_fb_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	struct fb_info *info;
+	struct sp_fb *spfb;
+	int ret;
+
+	if (fb_pages == 0)
+		return 0;
+
+	info = framebuffer_alloc(sizeof(struct sp_fb), &pdev->dev);
+	if (!info)
+		return -ENOMEM;
+
+	spfb = info->par;
+	spfb->drvdata = drvdata;
+	spfb->size = PAGE_ALIGN(CONSOLE_FRAMEBUFFER_SIZE * fb_pages);
+	spfb->paddr = gen_pool_alloc(drvdata->mem_pool, spfb->size);
+	INIT_WORK(&spfb->pan_work, sp_fb_pan_work);
+	if (!spfb->paddr)
+	{
+		ret = -ENOMEM;
+		goto err_release;
+	}
+
+	info->screen_base = ioremap_wc(spfb->paddr, spfb->size);
+	if (!info->screen_base)
+	{
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	info->screen_size = spfb->size;
+	memset_io(info->screen_base, 0, spfb->size);
+
+	info->fbops = &sp_fb_ops;
+	info->flags = FBINFO_HWACCEL_YPAN;
+	info->pseudo_palette = spfb->pseudo_palette;
+
+	strscpy(info->fix.id, DEVICE_NAME, sizeof(info->fix.id));
+	info->fix.type = FB_TYPE_PACKED_PIXELS;
+	info->fix.ypanstep = 1;
+	info->fix.accel = FB_ACCEL_NONE;
+	info->fix.smem_start = spfb->paddr;
+	info->fix.smem_len = spfb->size;
+
+	// Same 640x480 16 bit mode simple-framebuffer used, with room to pan
+	info->var.xres = 640;
+	info->var.yres = 480;
+	info->var.yres_virtual = 480 * fb_pages;
+	info->var.bits_per_pixel = 16;
+	info->var.activate = FB_ACTIVATE_NOW;
+	info->var.height = -1;
+	info->var.width = -1;
+	info->var.vmode = FB_VMODE_NONINTERLACED;
+
+	ret = sp_fb_check_var(&info->var, info);
+	if (ret)
+		goto err_unmap;
+
+	ret = fb_alloc_cmap(&info->cmap, 256, 0);
+	if (ret)
+		goto err_unmap;
+
+	// Take the console over from simple-framebuffer
+	ret = aperture_remove_conflicting_devices(CONSOLE_FRAMEBUFFER_ADDR, CONSOLE_FRAMEBUFFER_SIZE, DEVICE_NAME);
+	if (ret)
+		goto err_cmap;
+
+	drvdata->fb_info = info;
+	sp_fb_set_par(info);
+
+	ret = register_framebuffer(info);
+	if (ret)
+		goto err_restore;
+
+	printk(KERN_INFO "%s: framebuffer registered with %u pages\n", DEVICE_NAME, info->var.yres_virtual / info->var.yres);
+
+	return 0;
+
+err_restore:
+	drvdata->fb_info = NULL;
+	mutex_lock(&drvdata->fifo_lock);
+	sp_console_scanout(drvdata);
+	mutex_unlock(&drvdata->fifo_lock);
+err_cmap:
+	fb_dealloc_cmap(&info->cmap);
+err_unmap:
+	iounmap(info->screen_base);
+err_free:
+	gen_pool_free(drvdata->mem_pool, spfb->paddr, spfb->size);
+err_release:
+	framebuffer_release(info);
+	return ret;
+}
+
+static void sp_fb_exit(struct my_driver_data *drvdata)
+{
+	struct fb_info *info = drvdata->fb_info;
+	struct sp_fb *spfb;
+
+	if (!info)
+		return;
+
+	spfb = info->par;
+	unregister_framebuffer(info);
+	cancel_work_sync(&spfb->pan_work);
+
+	// Point the scanout away from memory that is about to be released
+	drvdata->fb_info = NULL;
+	mutex_lock(&drvdata->fifo_lock);
+	sp_console_scanout(drvdata);
+	mutex_unlock(&drvdata->fifo_lock);
+
+	fb_dealloc_cmap(&info->cmap);
+	iounmap(info->screen_base);
+	gen_pool_free(drvdata->mem_pool, spfb->paddr, spfb->size);
+	framebuffer_release(info);
+}
+
+#else
+
+static void sp_fb_get_scanout(struct my_driver_data *drvdata, uint32_t *vmode, uint32_t *page)
+{
+}
+
+static int sp_fb_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	return 0;
+}
+
+static void sp_fb_exit(struct my_driver_data *drvdata)
+{
+}
+
+#endif
+
+// Point the VPU at whichever framebuffer the linux console is drawing into, caller holds fifo_lock
+static void sp_console_scanout(struct my_driver_data *drvdata)
+{
+	uint32_t vmode = MAKEVMODEINFO((uint32_t)ECM_16bit_RGB, (uint32_t)EVM_640_Wide, (uint32_t)EVS_Enable);
+	uint32_t page = CONSOLE_FRAMEBUFFER_ADDR;
+
+	sp_fb_get_scanout(drvdata, &vmode, &page);
+
+	sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVPAGE);
+	sp_reg_write(drvdata, ERB_Video, 0, page);
+	sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVMODE);
+	sp_reg_write(drvdata, ERB_Video, 0, vmode);
+}
+
+#if IS_REACHABLE(CONFIG_DRM_KMS_HELPER)
+
+struct sp_drm {
+	struct drm_device drm;
+	struct drm_simple_display_pipe pipe;
+	struct drm_connector connector;
+	struct my_driver_data *drvdata;
+};
+
+// GEM buffers are carved out of the reserved memory so the VPU can scan them out directly
+struct sp_gem_object {
+	struct drm_gem_object base;
+	unsigned long paddr;
+};
+
+#define to_sp_drm(_drm)		container_of(_drm, struct sp_drm, drm)
+#define to_sp_gem(_obj)		container_of(_obj, struct sp_gem_object, base)
+
+static const uint32_t sp_drm_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_C8,
+};
+
+// 640 wide mode is standard VGA timing, 320 wide mode doubles pixels and lines of the same signal
+static const struct drm_display_mode sp_drm_modes[] = {
+	{ DRM_MODE("640x480", DRM_MODE_TYPE_DRIVER | DRM_MODE_TYPE_PREFERRED, 25175, 640, 656, 752, 800, 0, 480, 490, 492, 525, 0, DRM_MODE_FLAG_NHSYNC | DRM_MODE_FLAG_NVSYNC) },
+	{ DRM_MODE("320x240", DRM_MODE_TYPE_DRIVER, 6294, 320, 328, 376, 400, 0, 240, 245, 246, 262, 0, DRM_MODE_FLAG_NHSYNC | DRM_MODE_FLAG_NVSYNC) },
+};
+
+static void sp_gem_free(struct drm_gem_object *obj)
+{
+	struct sp_gem_object *spobj = to_sp_gem(obj);
+	struct sp_drm *spdrm = to_sp_drm(obj->dev);
+
+	gen_pool_free(spdrm->drvdata->mem_pool, spobj->paddr, obj->size);
+	drm_gem_object_release(obj);
+	kfree(spobj);
+}
+
+static int sp_gem_mmap(struct drm_gem_object *obj, struct vm_area_struct *vma)
+{
+	struct sp_gem_object *spobj = to_sp_gem(obj);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	// Drop the fake offset DRM used to find the object, what is left is the offset into it
+	vma->vm_pgoff -= drm_vma_node_start(&obj->vma_node);
+	if (vma->vm_pgoff > (obj->size >> PAGE_SHIFT) || size > obj->size - (vma->vm_pgoff << PAGE_SHIFT))
+		return -EINVAL;
+
+	vma->vm_page_prot = pgprot_writecombine(vm_get_page_prot(vma->vm_flags));
+
+	return remap_pfn_range(vma, vma->vm_start, (spobj->paddr >> PAGE_SHIFT) + vma->vm_pgoff, size, vma->vm_page_prot);
+}
+
+static const struct vm_operations_struct sp_gem_vm_ops = {
+	.open	= drm_gem_vm_open,
+	.close	= drm_gem_vm_close,
+};
+
+static const struct drm_gem_object_funcs sp_gem_funcs = {
+	.free	= sp_gem_free,
+	.mmap	= sp_gem_mmap,
+	.vm_ops	= &sp_gem_vm_ops,
+};
+
+static struct sp_gem_object *sp_gem_create(struct drm_device *drm, size_t size)
+{
+	struct sp_drm *spdrm = to_sp_drm(drm);
+	struct sp_gem_object *spobj;
+
+	size = PAGE_ALIGN(size);
+
+	spobj = kzalloc(sizeof(struct sp_gem_object), GFP_KERNEL);
+	if (!spobj)
+		return ERR_PTR(-ENOMEM);
+
+	spobj->paddr = gen_pool_alloc(spdrm->drvdata->mem_pool, size);
+	if (!spobj->paddr)
+	{
+		kfree(spobj);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	spobj->base.funcs = &sp_gem_funcs;
+	drm_gem_private_object_init(drm, &spobj->base, size);
+
+	return spobj;
+}
+
+static int sp_drm_dumb_create(struct drm_file *file, struct drm_device *drm, struct drm_mode_create_dumb *args)
+{
+	struct sp_gem_object *spobj;
+	int ret;
+
+	// Scanout reads lines back to back, so there is no pitch padding
+	args->pitch = DIV_ROUND_UP(args->width * args->bpp, 8);
+	args->size = PAGE_ALIGN((uint64_t)args->pitch * args->height);
+
+	spobj = sp_gem_create(drm, args->size);
+	if (IS_ERR(spobj))
+		return PTR_ERR(spobj);
+
+	ret = drm_gem_handle_create(file, &spobj->base, &args->handle);
+	drm_gem_object_put(&spobj->base);
+
+	return ret;
+}
+
+// Physical address of the first pixel the VPU should scan out for a framebuffer
+static uint32_t sp_drm_fb_addr(struct drm_framebuffer *fb)
+{
+	return to_sp_gem(drm_gem_fb_get_obj(fb, 0))->paddr + fb->offsets[0];
+}
+
+static uint32_t sp_drm_vmode(struct drm_display_mode *mode, struct drm_framebuffer *fb)
+{
+	uint32_t cmode = fb->format->format == DRM_FORMAT_C8 ? ECM_8bit_Indexed : ECM_16bit_RGB;
+	uint32_t vmode = mode->hdisplay == 320 ? EVM_320_Wide : EVM_640_Wide;
+
+	return MAKEVMODEINFO(cmode, vmode, (uint32_t)EVS_Enable);
+}
+
+static enum drm_mode_status sp_drm_mode_valid(struct drm_simple_display_pipe *pipe, const struct drm_display_mode *mode)
+{
+	if (mode->hdisplay == 640 && mode->vdisplay == 480)
+		return MODE_OK;
+	if (mode->hdisplay == 320 && mode->vdisplay == 240)
+		return MODE_OK;
+	return MODE_BAD;
+}
+
+static int sp_drm_check(struct drm_simple_display_pipe *pipe, struct drm_plane_state *plane_state, struct drm_crtc_state *crtc_state)
+{
+	struct drm_framebuffer *fb = plane_state->fb;
+
+	if (!fb)
+		return 0;
+
+	// No scaling or panning, the framebuffer is scanned out as is
+	if (fb->pitches[0] != fb->width * fb->format->cpp[0] || fb->width != crtc_state->mode.hdisplay || fb->height != crtc_state->mode.vdisplay)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void sp_drm_load_palette(struct my_driver_data *drvdata, struct drm_crtc_state *crtc_state)
+{
+	struct drm_color_lut *lut;
+	uint32_t i;
+
+	if (!crtc_state->color_mgmt_changed || !crtc_state->gamma_lut)
+		return;
+
+	// In 8 bit indexed mode the gamma table doubles as the palette
+	lut = crtc_state->gamma_lut->data;
+	for (i = 0; i < 256; ++i)
+		sp_reg_write(drvdata, ERB_Palette, i, ((lut[i].red >> 8) << 16) | ((lut[i].green >> 8) << 8) | (lut[i].blue >> 8));
+}
+
+static void sp_drm_send_event(struct drm_crtc *crtc)
+{
+	struct drm_pending_vblank_event *event = crtc->state->event;
+
+	if (!event)
+		return;
+
+	crtc->state->event = NULL;
+
+	// Flip completion is reported on the vblank that latches the new page
+	spin_lock_irq(&crtc->dev->event_lock);
+	if (drm_crtc_vblank_get(crtc) == 0)
+		drm_crtc_arm_vblank_event(crtc, event);
+	else
+		drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irq(&crtc->dev->event_lock);
+}
+
+static void sp_drm_enable(struct drm_simple_display_pipe *pipe, struct drm_crtc_state *crtc_state, struct drm_plane_state *plane_state)
+{
+	struct sp_drm *spdrm = to_sp_drm(pipe->crtc.dev);
+	struct my_driver_data *drvdata = spdrm->drvdata;
+
+	// Vblank is detected by the event timer
+	mutex_lock(&drvdata->event_users_lock);
+	sp_event_timer_get(drvdata);
+	mutex_unlock(&drvdata->event_users_lock);
+
+	mutex_lock(&drvdata->fifo_lock);
+	sp_drm_load_palette(drvdata, crtc_state);
+	sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVMODE);
+	sp_reg_write(drvdata, ERB_Video, 0, sp_drm_vmode(&crtc_state->mode, plane_state->fb));
+	sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVPAGE);
+	sp_reg_write(drvdata, ERB_Video, 0, sp_drm_fb_addr(plane_state->fb));
+	mutex_unlock(&drvdata->fifo_lock);
+
+	WRITE_ONCE(drvdata->drm_active, true);
+	drm_crtc_vblank_on(&pipe->crtc);
+	sp_drm_send_event(&pipe->crtc);
+}
+
+static void sp_drm_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct sp_drm *spdrm = to_sp_drm(pipe->crtc.dev);
+	struct my_driver_data *drvdata = spdrm->drvdata;
+
+	drm_crtc_vblank_off(&pipe->crtc);
+	WRITE_ONCE(drvdata->drm_active, false);
+
+	// Hand the display back to the linux console
+	mutex_lock(&drvdata->fifo_lock);
+	sp_console_scanout(drvdata);
+	mutex_unlock(&drvdata->fifo_lock);
+
+	mutex_lock(&drvdata->event_users_lock);
+	sp_event_timer_put(drvdata);
+	mutex_unlock(&drvdata->event_users_lock);
+}
+
+static void sp_drm_update(struct drm_simple_display_pipe *pipe, struct drm_plane_state *old_state)
+{
+	struct sp_drm *spdrm = to_sp_drm(pipe->crtc.dev);
+	struct my_driver_data *drvdata = spdrm->drvdata;
+	struct drm_plane_state *state = pipe->plane.state;
+	struct drm_crtc_state *crtc_state = pipe->crtc.state;
+
+	if (state->fb && state->crtc)
+	{
+		mutex_lock(&drvdata->fifo_lock);
+		sp_drm_load_palette(drvdata, crtc_state);
+		if (!old_state->fb || old_state->fb->format != state->fb->format)
+		{
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVMODE);
+			sp_reg_write(drvdata, ERB_Video, 0, sp_drm_vmode(&crtc_state->mode, state->fb));
+		}
+		if (old_state->fb != state->fb)
+		{
+			// New page is latched by the VPU at the next vblank
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SETVPAGE);
+			sp_reg_write(drvdata, ERB_Video, 0, sp_drm_fb_addr(state->fb));
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SYNCSWAP);
+			atomic64_add(3 * sizeof(uint32_t), &drvdata->fifo_bytes[ERB_Video]);
+		}
+		mutex_unlock(&drvdata->fifo_lock);
+	}
+
+	sp_drm_send_event(&pipe->crtc);
+}
+
+// The event timer runs for as long as the pipe is enabled, so there is nothing to switch
+static int sp_drm_enable_vblank(struct drm_simple_display_pipe *pipe)
+{
+	return 0;
+}
+
+static void sp_drm_disable_vblank(struct drm_simple_display_pipe *pipe)
+{
+}
+
+static const struct drm_simple_display_pipe_funcs sp_drm_pipe_funcs = {
+	.mode_valid		= sp_drm_mode_valid,
+	.check			= sp_drm_check,
+	.enable			= sp_drm_enable,
+	.disable		= sp_drm_disable,
+	.update			= sp_drm_update,
+	.enable_vblank	= sp_drm_enable_vblank,
+	.disable_vblank	= sp_drm_disable_vblank,
+};
+
+static int sp_drm_get_modes(struct drm_connector *connector)
+{
+	uint32_t i;
+
+	for (i = 0; i < ARRAY_SIZE(sp_drm_modes); ++i)
+	{
+		struct drm_display_mode *mode = drm_mode_duplicate(connector->dev, &sp_drm_modes[i]);
+		if (!mode)
+			break;
+		drm_mode_probed_add(connector, mode);
+	}
+
+	return i;
+}
+
+static const struct drm_connector_helper_funcs sp_drm_connector_helper_funcs = {
+	.get_modes	= sp_drm_get_modes,
+};
+
+static const struct drm_connector_funcs sp_drm_connector_funcs = {
+	.fill_modes				= drm_helper_probe_single_connector_modes,
+	.destroy				= drm_connector_cleanup,
+	.reset					= drm_atomic_helper_connector_reset,
+	.atomic_duplicate_state	= drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state	= drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_mode_config_funcs sp_drm_mode_config_funcs = {
+	.fb_create		= drm_gem_fb_create,
+	.atomic_check	= drm_atomic_helper_check,
+	.atomic_commit	= drm_atomic_helper_commit,
+};
+
+DEFINE_DRM_GEM_FOPS(sp_drm_fops);
+
+static const struct drm_driver sp_drm_driver = {
+	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+	.fops				= &sp_drm_fops,
+	.dumb_create		= sp_drm_dumb_create,
+	.name				= DEVICE_NAME,
+	.desc				= "Sandpiper VPU",
+	.date				= "20261016",
+	.major				= 1,
+	.minor				= 0,
+};
+
+static void sp_drm_vblank(struct my_driver_data *drvdata)
+{
+	if (READ_ONCE(drvdata->drm_active))
+		drm_crtc_handle_vblank(&drvdata->drm->pipe.crtc);
+}
+
+static int sp_drm_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	struct sp_drm *spdrm;
+	struct drm_device *drm;
+	int ret;
+
+	spdrm = devm_drm_dev_alloc(&pdev->dev, &sp_drm_driver, struct sp_drm, drm);
+	if (IS_ERR(spdrm))
+		return PTR_ERR(spdrm);
+
+	spdrm->drvdata = drvdata;
+	drm = &spdrm->drm;
+
+	ret = drmm_mode_config_init(drm);
+	if (ret)
+		return ret;
+
+	drm->mode_config.min_width = 320;
+	drm->mode_config.min_height = 240;
+	drm->mode_config.max_width = 640;
+	drm->mode_config.max_height = 480;
+	drm->mode_config.funcs = &sp_drm_mode_config_funcs;
+
+	ret = drm_vblank_init(drm, 1);
+	if (ret)
+		return ret;
+
+	drm_connector_helper_add(&spdrm->connector, &sp_drm_connector_helper_funcs);
+	ret = drm_connector_init(drm, &spdrm->connector, &sp_drm_connector_funcs, DRM_MODE_CONNECTOR_HDMIA);
+	if (ret)
+		return ret;
+
+	ret = drm_simple_display_pipe_init(drm, &spdrm->pipe, &sp_drm_pipe_funcs, sp_drm_formats, ARRAY_SIZE(sp_drm_formats), NULL, &spdrm->connector);
+	if (ret)
+		return ret;
+
+	// The crtc GAMMA_LUT property is how DRM clients set the 8 bit palette
+	drm_mode_crtc_set_gamma_size(&spdrm->pipe.crtc, 256);
+	drm_crtc_enable_color_mgmt(&spdrm->pipe.crtc, 0, false, 256);
+
+	drm_mode_config_reset(drm);
+
+	ret = drm_dev_register(drm, 0);
+	if (ret)
+		return ret;
+
+	drvdata->drm = spdrm;
+	printk(KERN_INFO "%s: DRM device registered\n", DEVICE_NAME);
+
+	return 0;
+}
+
+static void sp_drm_exit(struct my_driver_data *drvdata)
+{
+	if (!drvdata->drm)
+		return;
+
+	drm_dev_unregister(&drvdata->drm->drm);
+	drm_atomic_helper_shutdown(&drvdata->drm->drm);
+}
+
+#else
+
+static int sp_drm_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	return 0;
+}
+
+static void sp_drm_exit(struct my_driver_data *drvdata)
+{
+}
+
+static void sp_drm_vblank(struct my_driver_data *drvdata)
+{
+}
+
+#endif
+
+#if IS_REACHABLE(CONFIG_UIO)
+
+// Maps are selected by mmap offset N * PAGE_SIZE, the status page lives in the memory map at STATUS_PAGE_ADDR - PHYS_ADDR
+static const struct {
+	const char *name;
+	phys_addr_t addr;
+	resource_size_t size;
+} sp_uio_maps[] = {
+	{ "audio",		AUDIO_CTRL_REGS_ADDR,	DEVICE_MEMORY_SIZE },
+	{ "video",		VIDEO_CTRL_REGS_ADDR,	DEVICE_MEMORY_SIZE },
+	{ "palette",	PALETTE_CTRL_REGS_ADDR,	DEVICE_MEMORY_SIZE },
+	{ "vcp",		VCP_CTRL_REGS_ADDR,		DEVICE_MEMORY_SIZE },
+	{ "memory",		PHYS_ADDR,				RESERVED_MEMORY_SIZE },
+};
+
+// The event timer only runs while the uio device is open, same as for read() and poll() on the character device
+static int sp_uio_open(struct uio_info *info, struct inode *inode)
+{
+	struct my_driver_data *drvdata = info->priv;
+
+	mutex_lock(&drvdata->event_users_lock);
+	sp_event_timer_get(drvdata);
+	mutex_unlock(&drvdata->event_users_lock);
+
+	return 0;
+}
+
+static int sp_uio_release(struct uio_info *info, struct inode *inode)
+{
+	struct my_driver_data *drvdata = info->priv;
+
+	mutex_lock(&drvdata->event_users_lock);
+	sp_event_timer_put(drvdata);
+	mutex_unlock(&drvdata->event_users_lock);
+
+	return 0;
+}
+
+static int sp_uio_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	struct uio_info *info;
+	int i, ret;
+
+	BUILD_BUG_ON(ARRAY_SIZE(sp_uio_maps) > MAX_UIO_MAPS);
+
+	info = devm_kzalloc(&pdev->dev, sizeof(*info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+
+	info->name = DEVICE_NAME;
+	info->version = "1";
+	info->priv = drvdata;
+	info->open = sp_uio_open;
+	info->release = sp_uio_release;
+
+	// There is no interrupt line, every vblank or audio buffer the event timer sees counts as one interrupt
+	info->irq = UIO_IRQ_CUSTOM;
+
+	for (i = 0; i < ARRAY_SIZE(sp_uio_maps); i++)
+	{
+		info->mem[i].name = sp_uio_maps[i].name;
+		info->mem[i].addr = sp_uio_maps[i].addr;
+		info->mem[i].size = sp_uio_maps[i].size;
+		info->mem[i].memtype = UIO_MEM_PHYS;
+	}
+
+	ret = uio_register_device(&pdev->dev, info);
+	if (ret < 0)
+		return ret;
+
+	drvdata->uio_info = info;
+
+	printk(KERN_INFO "%s: UIO device registered, kernel side display and audio left off\n", DEVICE_NAME);
+
+	return 0;
+}
+
+static void sp_uio_exit(struct my_driver_data *drvdata)
+{
+	if (drvdata->uio_info)
+		uio_unregister_device(drvdata->uio_info);
+}
+
+// Called from the event timer, read() on the uio fd returns the total event count
+static void sp_uio_event(struct my_driver_data *drvdata)
+{
+	if (drvdata->uio_info)
+		uio_event_notify(drvdata->uio_info);
+}
+
+#else
+
+static int sp_uio_init(struct platform_device *pdev, struct my_driver_data *drvdata)
+{
+	return -ENODEV;
+}
+
+static void sp_uio_exit(struct my_driver_data *drvdata)
+{
+}
+
+static void sp_uio_event(struct my_driver_data *drvdata)
+{
+}
+
+#endif
+
+static int dev_open(struct inode *inode, struct file *file)
+{
+    struct my_driver_data *drvdata = container_of(inode->i_cdev, struct my_driver_data, cdev);
+	struct my_file_data *filedata;
+
+	filedata = kzalloc(sizeof(struct my_file_data), GFP_KERNEL);
+	if (!filedata)
+		return -ENOMEM;
+
+	filedata->drvdata = drvdata;
+	filedata->map_mode = EMM_Uncached;
+	filedata->event_mask = EVENT_MASK(EET_VBlank);
+	mutex_init(&filedata->alloc_lock);
+	INIT_LIST_HEAD(&filedata->allocs);
+    file->private_data = filedata;
+
+	// Inc reference count
+	drvdata->open_count++;
+
+	return 0;
+}
+
+static int dev_release(struct inode *inode, struct file *file)
+{
+	struct my_driver_data *drvdata = container_of(inode->i_cdev, struct my_driver_data, cdev);
+
+	sp_events_disable(file->private_data);
+	sp_free_all(file->private_data);
+	kfree(file->private_data);
+
+	// Decrement reference count
+	drvdata->open_count--;
+
+	// Tear down device states
+	// This should allow us to restore device state without having to install signal handlers in user space
+	// With the UIO binding a userspace driver owns the units, so their state is left alone
+	if (drvdata->open_count == 0 && !drvdata->uio_info)
+	{
+		trace_sandpiper_teardown(ERB_Video, !READ_ONCE(drvdata->drm_active));
+		trace_sandpiper_teardown(ERB_Audio, !READ_ONCE(drvdata->pcm_running));
+		trace_sandpiper_teardown(ERB_VCP, true);
+
+		// A doorbell still queued would replay old ring entries after the reset stream, and entries left
+		// behind, or reserved by a producer that died before publishing them, must not reach the next client
+		cancel_work_sync(&drvdata->ring_work);
+		sp_ring_reset(drvdata);
+
+		// The whole reset stream goes out under the FIFO lock so no other writer can land in the middle of a command
+		mutex_lock(&drvdata->fifo_lock);
+
+		// VPU, unless a DRM client owns the scanout
+		if (!READ_ONCE(drvdata->drm_active))
+		{
+			// Set video mode and scanout back to the linux framebuffer
+			sp_console_scanout(drvdata);
+
+			// Reset VPU control registers
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_WCONTROLREG | 0);
+
+			// Reset video scroll registers
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SHIFTCACHE);
+			sp_reg_write(drvdata, ERB_Video, 0, 0);
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SHIFTSCANOUT);
+			sp_reg_write(drvdata, ERB_Video, 0, 0);
+			sp_reg_write(drvdata, ERB_Video, 0, VPUCMD_SHIFTPIXEL);
+			sp_reg_write(drvdata, ERB_Video, 0, 0);
+		}
+
+		// APU, unless ALSA is playing through it
+		if (!READ_ONCE(drvdata->pcm_running))
+		{
+			// Stop all audio channels
+			sp_reg_write(drvdata, ERB_Audio, 0, APUCMD_SETRATE);
+			sp_reg_write(drvdata, ERB_Audio, 0, ASR_Halt);
+		}
+
+		// VCP
+		{
+			// Stop all VCP program activity
+			sp_reg_write(drvdata, ERB_VCP, 0, VCPEXEC | 0);
+		}
+
+		mutex_unlock(&drvdata->fifo_lock);
+	}
+
+	return 0;
+}
+
+static bool sp_fifo_block_valid(uint32_t block)
+{
+	return block == ERB_Audio || block == ERB_Video || block == ERB_VCP;
+}
+
+// ALSA writes APU command pairs from the event timer while a substream is open, user space words in between would split them
+static bool sp_audio_owned_by_pcm(struct my_driver_data *drvdata)
+{
+	return READ_ONCE(drvdata->pcm_substream) != NULL;
+}
+
+// Without backpressure the level register is not trusted and the FIFO always reads as empty
+static uint32_t sp_fifo_level(struct my_driver_data *drvdata, uint32_t block)
+{
+	return fifo_backpressure ? sp_reg_read(drvdata, block, FIFO_LEVEL_OFFSET) : 0;
+}
+
+static uint32_t sp_fifo_space(struct my_driver_data *drvdata, uint32_t block)
+{
+	uint32_t level = sp_fifo_level(drvdata, block);
+
+	return level >= FIFO_DEPTH_WORDS ? 0 : FIFO_DEPTH_WORDS - level;
+}
+
+// Wait until the FIFO can take n more words, space caches the last known free space, caller holds fifo_lock
+static long sp_fifo_reserve(struct my_driver_data *drvdata, uint32_t block, uint32_t n, uint32_t *space)
+{
+	if (*space < n)
+		*space = sp_fifo_space(drvdata, block);
+
+	if (*space < n)
+	{
+		unsigned long timeout = jiffies + msecs_to_jiffies(FIFO_WAIT_TIMEOUT_MS);
+
+		drvdata->fifo_overflows[block]++;
+		do
+		{
+			// Only a dying process or a stuck unit may abandon a stream half way, anything else would desync the FIFO
+			if (fatal_signal_pending(current))
+				return -EINTR;
+			if (time_after(jiffies, timeout))
+				return -ETIMEDOUT;
+			usleep_range(FIFO_WAIT_MIN_US, FIFO_WAIT_MAX_US);
+			*space = sp_fifo_space(drvdata, block);
+		} while (*space < n);
+	}
+
+	*space -= n;
+
+	return 0;
+}
+
+// Stream a user supplied list of command words into a command FIFO
+// Blocking callers wait for FIFO space as needed, non-blocking ones get -EAGAIN unless the whole list fits right away,
+// and -EINVAL for a list longer than the FIFO that could never fit. Without backpressure there is nothing to wait for
+static long sp_fifo_submit(struct my_driver_data *drvdata, uint32_t block, const uint32_t __user *words, uint32_t count, bool nonblock)
+{
+	uint32_t chunk[SUBMIT_CHUNK_WORDS];
+	uint32_t space = 0;
+	long ret = 0;
+
+	mutex_lock(&drvdata->fifo_lock);
+
+	if (nonblock && fifo_backpressure)
+	{
+		if (count > FIFO_DEPTH_WORDS)
+		{
+			mutex_unlock(&drvdata->fifo_lock);
+			return -EINVAL;
+		}
+
+		space = sp_fifo_space(drvdata, block);
+		if (space < count)
+		{
+			drvdata->fifo_overflows[block]++;
+			mutex_unlock(&drvdata->fifo_lock);
+			return -EAGAIN;
+		}
+	}
+
+	// Make sure any shared memory contents the commands refer to have landed first
+	wmb();
+
+	while (count)
+	{
+		uint32_t n = min_t(uint32_t, count, SUBMIT_CHUNK_WORDS);
+
+		if (copy_from_user(chunk, words, n * sizeof(uint32_t)))
+		{
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = sp_fifo_reserve(drvdata, block, n, &space);
+		if (ret)
+			break;
+
+		atomic64_add(n * sizeof(uint32_t), &drvdata->fifo_bytes[block]);
+
+		sp_reg_write_rep(drvdata, block, chunk, n);
+
+		words += n;
+		count -= n;
+	}
+
+	mutex_unlock(&drvdata->fifo_lock);
+
+	return ret;
+}
+
+static long sp_ioctl_vpu_submit(struct my_driver_data *drvdata, void __user *arg, bool nonblock)
+{
+	struct SPSubmit submit;
+
+	if (copy_from_user(&submit, arg, sizeof(submit)))
+		return -EFAULT;
+
+	return sp_fifo_submit(drvdata, ERB_Video, (const uint32_t __user *)(uintptr_t)submit.words, submit.count, nonblock);
+}
+
+static long sp_ioctl_fifo_status(struct my_driver_data *drvdata, void __user *arg)
+{
+	struct SPFifoStatus status;
+
+	if (copy_from_user(&status, arg, sizeof(status)))
+		return -EFAULT;
+
+	if (!sp_fifo_block_valid(status.block))
+		return -EINVAL;
+
+	status.level = sp_fifo_level(drvdata, status.block);
+	status.space = status.level >= FIFO_DEPTH_WORDS ? 0 : FIFO_DEPTH_WORDS - status.level;
+	status.depth = FIFO_DEPTH_WORDS;
+	status.overflows = READ_ONCE(drvdata->fifo_overflows[status.block]);
+
+	if (copy_to_user(arg, &status, sizeof(status)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long sp_ioctl_reg_program(struct my_driver_data *drvdata, void __user *arg)
+{
+	struct SPRegProgram program;
+	struct SPRegOp ops[REGPROGRAM_CHUNK_OPS];
+	struct SPRegOp __user *uops;
+	uint32_t count;
+	long ret = 0;
+
+	if (copy_from_user(&program, arg, sizeof(program)))
+		return -EFAULT;
+
+	uops = (struct SPRegOp __user *)(uintptr_t)program.ops;
+	count = program.count;
+
+	mutex_lock(&drvdata->fifo_lock);
+
+	while (count)
+	{
+		uint32_t n = min_t(uint32_t, count, REGPROGRAM_CHUNK_OPS);
+		uint32_t i;
+
+		if (copy_from_user(ops, uops, n * sizeof(struct SPRegOp)))
+		{
+			ret = -EFAULT;
+			break;
+		}
+
+		// Validate the whole chunk before touching any registers
+		for (i = 0; i < n; ++i)
+		{
+			if (ops[i].block >= ERB_Count || ops[i].op >= ERO_Count || ops[i].offset >= DEVICE_MEMORY_SIZE / sizeof(uint32_t))
+			{
+				ret = -EINVAL;
+				break;
+			}
+			if (ops[i].block == ERB_Audio && ops[i].op != ERO_Read && sp_audio_owned_by_pcm(drvdata))
+			{
+				ret = -EBUSY;
+				break;
+			}
+		}
+		if (ret)
+			break;
+
+		for (i = 0; i < n; ++i)
+		{
+			switch (ops[i].op) {
+				case ERO_Read:
+					ops[i].value = sp_reg_read(drvdata, ops[i].block, ops[i].offset);
+				break;
+
+				case ERO_Write:
+					sp_reg_write(drvdata, ops[i].block, ops[i].offset, ops[i].value);
+				break;
+
+				case ERO_MaskWrite:
+				{
+					uint32_t prev = sp_reg_read(drvdata, ops[i].block, ops[i].offset);
+					sp_reg_write(drvdata, ops[i].block, ops[i].offset, (prev & ~ops[i].mask) | (ops[i].value & ops[i].mask));
+					ops[i].value = prev;
+				}
+				break;
+			}
+		}
+
+		// Hand read results back
+		if (copy_to_user(uops, ops, n * sizeof(struct SPRegOp)))
+		{
+			ret = -EFAULT;
+			break;
+		}
+
+		uops += n;
+		count -= n;
+	}
+
+	mutex_unlock(&drvdata->fifo_lock);
+
+	return ret;
+}
+
+// Cache maintenance on a range of the shared memory region, offset is relative to PHYS_ADDR
+// Only the Zynq needs it, other architectures build the driver just to run the KUnit suite against a fake backend
+static void sp_cache_range(struct my_driver_data *drvdata, uint32_t offset, uint32_t size, uint32_t op)
+{
+#ifdef CONFIG_ARM
+	// The L1 data cache is physically tagged, so maintenance through the kernel alias covers every user mapping
+	void *start = drvdata->shared_mem + offset;
+	phys_addr_t phys = PHYS_ADDR + offset;
+
+	switch (op) {
+		case ECO_Clean:
+			__cpuc_flush_dcache_area(start, size);
+			outer_clean_range(phys, phys + size);
+		break;
+
+		// A plain invalidate would throw away dirty lines that share a cache line with the range,
+		// so stale lines are dropped by cleaning them first, inner cache before outer
+		case ECO_Invalidate:
+		case ECO_Flush:
+			__cpuc_flush_dcache_area(start, size);
+			outer_flush_range(phys, phys + size);
+		break;
+	}
+#endif
+}
+
+static struct SPRingHeader *sp_ring_header(struct my_driver_data *drvdata)
+{
+	return drvdata->shared_mem + (COMMAND_RING_ADDR - PHYS_ADDR);
+}
+
+static void sp_ring_work(struct work_struct *work)
+{
+	struct my_driver_data *drvdata = container_of(work, struct my_driver_data, ring_work);
+	struct SPRingHeader *header = sp_ring_header(drvdata);
+	struct SPRingEntry *entries = (void *)header + PAGE_SIZE;
+	uint32_t space[ERB_Count] = { 0 };
+	uint32_t budget = COMMAND_RING_ENTRIES;
+	bool more = false;
+	uint32_t tail;
+
+	mutex_lock(&drvdata->fifo_lock);
+
+	tail = drvdata->ring_tail;
+	for (;;)
+	{
+		struct SPRingEntry *entry = &entries[tail & (COMMAND_RING_ENTRIES - 1)];
+		uint32_t block;
+
+		if (smp_load_acquire(&entry->sequence) != tail + 1)
+			break;
+
+		// Producers that keep publishing would otherwise hold the FIFO lock and the kworker indefinitely
+		if (budget-- == 0)
+		{
+			more = true;
+			break;
+		}
+
+		// The palette block is plain registers and audio belongs to ALSA while it has a substream open, neither can be fed from the ring
+		block = READ_ONCE(entry->block);
+		if (!sp_fifo_block_valid(block) || (block == ERB_Audio && sp_audio_owned_by_pcm(drvdata)))
+			WRITE_ONCE(header->errors, header->errors + 1);
+		else
+		{
+			// A unit that stopped consuming leaves the entry in place for the next doorbell
+			if (sp_fifo_reserve(drvdata, block, 1, &space[block]))
+				break;
+			sp_reg_write(drvdata, block, 0, entry->word);
+			atomic64_add(sizeof(uint32_t), &drvdata->fifo_bytes[block]);
+		}
+
+		// Hand drained space back to producers as we go
+		if ((++tail % COMMAND_RING_BATCH) == 0)
+			smp_store_release(&header->tail, tail);
+	}
+	drvdata->ring_tail = tail;
+	smp_store_release(&header->tail, tail);
+
+	mutex_unlock(&drvdata->fifo_lock);
+
+	// Let submits, pans and flips in, then carry on with the rest
+	if (more)
+		queue_work(system_highpri_wq, &drvdata->ring_work);
+}
+
+// Callers make sure ring_work isn't running
+static void sp_ring_reset(struct my_driver_data *drvdata)
+{
+	struct SPRingHeader *header = sp_ring_header(drvdata);
+
+	// Zeroed sequences read as unpublished for every position of the first lap
+	memset(header, 0, COMMAND_RING_SIZE);
+	header->entries = COMMAND_RING_ENTRIES;
+	drvdata->ring_tail = 0;
+}
+
+static void sp_ring_init(struct my_driver_data *drvdata)
+{
+	sp_ring_reset(drvdata);
+	INIT_WORK(&drvdata->ring_work, sp_ring_work);
+}
+
+static long sp_vcp_load(struct my_driver_data *drvdata, const struct SPVCPProgram *program)
+{
+	uint32_t space = 0;
+	uint32_t offset;
+	long ret = 0;
+
+	if (program->size == 0 || program->size > VCP_PROGRAM_SLOT_SIZE || (program->size & 3))
+		return -EINVAL;
+
+	// Flags may not reach into the opcode and turn the command into something else
+	if (program->execflags & ~VCPEXEC_FLAGS_MASK)
+		return -EINVAL;
+
+	mutex_lock(&drvdata->fifo_lock);
+
+	offset = VCP_PROGRAM_ADDR - PHYS_ADDR + drvdata->vcp_slot * VCP_PROGRAM_SLOT_SIZE;
+	if (copy_from_user(drvdata->shared_mem + offset, (const void __user *)(uintptr_t)program->program, program->size))
+	{
+		ret = -EFAULT;
+		goto out;
+	}
+
+	// The VCP fetches the program from memory, so it has to leave the CPU caches first
+	sp_cache_range(drvdata, offset, program->size, ECO_Clean);
+
+	ret = sp_fifo_reserve(drvdata, ERB_VCP, 5, &space);
+	if (ret)
+		goto out;
+
+	sp_reg_write(drvdata, ERB_VCP, 0, VCPSETBUFFERSIZE);
+	sp_reg_write(drvdata, ERB_VCP, 0, program->size / sizeof(uint32_t));
+	sp_reg_write(drvdata, ERB_VCP, 0, VCPSTARTDMA);
+	sp_reg_write(drvdata, ERB_VCP, 0, PHYS_ADDR + offset);
+	sp_reg_write(drvdata, ERB_VCP, 0, VCPEXEC | program->execflags);
+	atomic64_add(5 * sizeof(uint32_t), &drvdata->fifo_bytes[ERB_VCP]);
+
+	drvdata->vcp_slot = (drvdata->vcp_slot + 1) % VCP_PROGRAM_SLOTS;
+
+out:
+	mutex_unlock(&drvdata->fifo_lock);
+
+	return ret;
+}
+
+static long sp_ioctl_vcp_load(struct my_driver_data *drvdata, void __user *arg)
+{
+	struct SPVCPProgram program;
+
+	if (copy_from_user(&program, arg, sizeof(program)))
+		return -EFAULT;
+
+	return sp_vcp_load(drvdata, &program);
+}
+
+static long sp_palette_load(struct my_file_data *filedata, const struct SPPalette *palette)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
+	unsigned long flags;
+	uint32_t *entries;
+	uint32_t i;
+
+	if (palette->latch >= EPL_Count || palette->first >= PALETTE_ENTRIES || palette->count == 0 || palette->count > PALETTE_ENTRIES - palette->first)
+		return -EINVAL;
+
+	entries = kmalloc_array(palette->count, sizeof(uint32_t), GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	if (copy_from_user(entries, (const void __user *)(uintptr_t)palette->entries, palette->count * sizeof(uint32_t)))
+	{
+		kfree(entries);
+		return -EFAULT;
+	}
+
+	if (palette->latch == EPL_Immediate)
+	{
+		for (i = 0; i < palette->count; ++i)
+			sp_reg_write(drvdata, ERB_Palette, palette->first + i, entries[i]);
+	}
+	else
+	{
+		// Vblank is found by the event timer, keep it running for this file
+		sp_events_enable(filedata);
+
+		spin_lock_irqsave(&drvdata->event_lock, flags);
+		memcpy(&drvdata->palette_staged[palette->first], entries, palette->count * sizeof(uint32_t));
+		bitmap_set(drvdata->palette_dirty, palette->first, palette->count);
+		spin_unlock_irqrestore(&drvdata->event_lock, flags);
+	}
+
+	kfree(entries);
+
+	return 0;
+}
+
+static long sp_ioctl_palette_load(struct my_file_data *filedata, void __user *arg)
+{
+	struct SPPalette palette;
+
+	if (copy_from_user(&palette, arg, sizeof(palette)))
+		return -EFAULT;
+
+	return sp_palette_load(filedata, &palette);
+}
+
+static long sp_ioctl_cache_sync(struct my_file_data *filedata, void __user *arg)
+{
+	struct SPCacheOp cacheop;
+
+	if (copy_from_user(&cacheop, arg, sizeof(cacheop)))
+		return -EFAULT;
+
+	if (cacheop.op >= ECO_Count || cacheop.offset >= RESERVED_MEMORY_SIZE || cacheop.size > RESERVED_MEMORY_SIZE - cacheop.offset)
+		return -EINVAL;
+
+	// Maintenance goes through the cached kernel alias, which only matches the attributes of a cached user mapping.
+	// Uncached and write-combined views need none, and cleaning behind them would mix attributes on the same memory
+	if (filedata->map_mode != EMM_Cached)
+		return -EINVAL;
+
+	// Only the caller's own allocations, the rest of the region belongs to the driver and other clients
+	if (!capable(CAP_SYS_RAWIO) && !sp_file_owns_range(filedata, PHYS_ADDR + cacheop.offset, cacheop.size))
+		return -EPERM;
+
+	sp_cache_range(filedata->drvdata, cacheop.offset, cacheop.size, cacheop.op);
+
+	return 0;
+}
+
+// Memory goes back to the pool once the owner and every exported dma-buf have let go
+static void sp_allocation_release(struct kref *ref)
+{
+	struct sp_allocation *alloc = container_of(ref, struct sp_allocation, ref);
+
+	gen_pool_free(alloc->drvdata->mem_pool, alloc->paddr, alloc->size);
+	kfree(alloc);
+}
+
+static struct sg_table *sp_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+	struct sp_allocation *alloc = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	dma_addr_t addr;
+
+	sgt = kzalloc(sizeof(struct sg_table), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	if (sg_alloc_table(sgt, 1, GFP_KERNEL))
+	{
+		kfree(sgt);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	// The carveout has no struct pages, so importers get a single DMA mapped segment without one
+	addr = dma_map_resource(attach->dev, alloc->paddr, alloc->size, dir, 0);
+	if (dma_mapping_error(attach->dev, addr))
+	{
+		sg_free_table(sgt);
+		kfree(sgt);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	sg_dma_address(sgt->sgl) = addr;
+	sg_dma_len(sgt->sgl) = alloc->size;
+
+	return sgt;
+}
+
+static void sp_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_resource(attach->dev, sg_dma_address(sgt->sgl), sg_dma_len(sgt->sgl), dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void sp_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct sp_allocation *alloc = dmabuf->priv;
+
+	kref_put(&alloc->ref, sp_allocation_release);
+}
+
+// CPU mappings of a dma-buf are cached, DMA_BUF_IOCTL_SYNC brackets access with cache maintenance
+static int sp_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct sp_allocation *alloc = dmabuf->priv;
+
+	if (dir != DMA_TO_DEVICE)
+		sp_cache_range(alloc->drvdata, alloc->paddr - PHYS_ADDR, alloc->size, ECO_Invalidate);
+
+	return 0;
+}
+
+static int sp_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct sp_allocation *alloc = dmabuf->priv;
+
+	if (dir != DMA_FROM_DEVICE)
+		sp_cache_range(alloc->drvdata, alloc->paddr - PHYS_ADDR, alloc->size, ECO_Clean);
+
+	return 0;
+}
+
+static int sp_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct sp_allocation *alloc = dmabuf->priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (offset >= alloc->size || size > alloc->size - offset)
+		return -EINVAL;
+
+	return remap_pfn_range(vma, vma->vm_start, (alloc->paddr + offset) >> PAGE_SHIFT, size, vma->vm_page_prot);
+}
+
+static int sp_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct sp_allocation *alloc = dmabuf->priv;
+
+	// Cached kernel alias, same cache rules as user mappings
+	iosys_map_set_vaddr(map, alloc->drvdata->shared_mem + (alloc->paddr - PHYS_ADDR));
+
+	return 0;
+}
+
+static const struct dma_buf_ops sp_dmabuf_ops = {
+	.map_dma_buf		= sp_dmabuf_map,
+	.unmap_dma_buf		= sp_dmabuf_unmap,
+	.release			= sp_dmabuf_release,
+	.begin_cpu_access	= sp_dmabuf_begin_cpu_access,
+	.end_cpu_access		= sp_dmabuf_end_cpu_access,
+	.mmap				= sp_dmabuf_mmap,
+	.vmap				= sp_dmabuf_vmap,
+};
+
+static long sp_ioctl_export(struct my_file_data *filedata, void __user *arg)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct sp_allocation *alloc, *found = NULL;
+	struct dma_buf *dmabuf;
+	struct SPExport req;
+	int fd;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+
+	mutex_lock(&filedata->alloc_lock);
+	list_for_each_entry(alloc, &filedata->allocs, node)
+	{
+		if (alloc->paddr == req.address)
+		{
+			found = alloc;
+			kref_get(&found->ref);
+			break;
+		}
+	}
+	mutex_unlock(&filedata->alloc_lock);
+
+	if (!found)
+		return -EINVAL;
+
+	exp_info.ops = &sp_dmabuf_ops;
+	exp_info.size = found->size;
+	exp_info.flags = req.flags & O_ACCMODE;
+	exp_info.priv = found;
+
+	// The dma-buf owns the reference taken above from here on
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf))
+	{
+		kref_put(&found->ref, sp_allocation_release);
+		return PTR_ERR(dmabuf);
+	}
+
+	// The fd only goes live once user space is sure to learn its number
+	fd = get_unused_fd_flags(req.flags & O_CLOEXEC);
+	if (fd < 0)
+	{
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	req.fd = fd;
+	if (copy_to_user(arg, &req, sizeof(req)))
+	{
+		put_unused_fd(fd);
+		dma_buf_put(dmabuf);
+		return -EFAULT;
+	}
+
+	fd_install(fd, dmabuf->file);
+
+	return 0;
+}
+
+static long sp_ioctl_alloc(struct my_file_data *filedata, void __user *arg)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
+	struct sp_allocation *alloc;
+	struct SPAlloc req;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (!drvdata->mem_pool)
+		return -ENODEV;
+	if (req.size == 0 || req.size > POOL_MEMORY_SIZE)
+		return -EINVAL;
+
+	alloc = kzalloc(sizeof(struct sp_allocation), GFP_KERNEL);
+	if (!alloc)
+		return -ENOMEM;
+
+	// Page granularity so every allocation can be mapped on its own
+	kref_init(&alloc->ref);
+	alloc->drvdata = drvdata;
+	alloc->size = PAGE_ALIGN(req.size);
+	alloc->paddr = gen_pool_alloc(drvdata->mem_pool, alloc->size);
+	if (!alloc->paddr)
+	{
+		kfree(alloc);
+		return -ENOMEM;
+	}
+
+	req.size = alloc->size;
+	req.address = alloc->paddr;
+	if (copy_to_user(arg, &req, sizeof(req)))
+	{
+		gen_pool_free(drvdata->mem_pool, alloc->paddr, alloc->size);
+		kfree(alloc);
+		return -EFAULT;
+	}
+
+	mutex_lock(&filedata->alloc_lock);
+	list_add(&alloc->node, &filedata->allocs);
+	mutex_unlock(&filedata->alloc_lock);
+
+	return 0;
+}
+
+static long sp_ioctl_free(struct my_file_data *filedata, void __user *arg)
+{
+	struct sp_allocation *alloc;
+	struct SPAlloc req;
+	long ret = -EINVAL;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&filedata->alloc_lock);
+	list_for_each_entry(alloc, &filedata->allocs, node)
+	{
+		if (alloc->paddr == req.address)
+		{
+			list_del(&alloc->node);
+			kref_put(&alloc->ref, sp_allocation_release);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&filedata->alloc_lock);
+
+	return ret;
+}
+
+static void sp_free_all(struct my_file_data *filedata)
+{
+	struct sp_allocation *alloc, *next;
+
+	list_for_each_entry_safe(alloc, next, &filedata->allocs, node)
+	{
+		list_del(&alloc->node);
+		kref_put(&alloc->ref, sp_allocation_release);
+	}
+}
+
+// True if [paddr, paddr+size) lies inside one allocation owned by the file
+static bool sp_file_owns_range(struct my_file_data *filedata, unsigned long paddr, unsigned long size)
+{
+	struct sp_allocation *alloc;
+	bool owned = false;
+
+	mutex_lock(&filedata->alloc_lock);
+	list_for_each_entry(alloc, &filedata->allocs, node)
+	{
+		// Start has to be inside the allocation before the remaining length can be worked out without wrapping
+		if (paddr >= alloc->paddr && paddr - alloc->paddr < alloc->size && size <= alloc->size - (paddr - alloc->paddr))
+		{
+			owned = true;
+			break;
+		}
+	}
+	mutex_unlock(&filedata->alloc_lock);
+
+	return owned;
+}
+
+// Register block an ioctl mostly deals with, for tracing
+static uint32_t sp_ioctl_block(unsigned int cmd)
+{
+	switch (cmd) {
+		case SP_IOCTL_GET_AUDIO_CTL:
+		case SP_IOCTL_AUDIO_READ:
+		case SP_IOCTL_AUDIO_WRITE:
+			return ERB_Audio;
+		case SP_IOCTL_GET_VIDEO_CTL:
+		case SP_IOCTL_VIDEO_READ:
+		case SP_IOCTL_VIDEO_WRITE:
+		case SP_IOCTL_VPU_SUBMIT:
+			return ERB_Video;
+		case SP_IOCTL_GET_PALETTE_CTL:
+		case SP_IOCTL_PALETTE_READ:
+		case SP_IOCTL_PALETTE_WRITE:
+		case SP_IOCTL_PALETTE_LOAD:
+			return ERB_Palette;
+		case SP_IOCTL_GET_VCP_CTL:
+		case SP_IOCTL_VCP_READ:
+		case SP_IOCTL_VCP_WRITE:
+		case SP_IOCTL_VCP_LOAD:
+			return ERB_VCP;
+		default:
+			return ERB_Count;
+	}
+}
+
+// Legacy single register reads and writes, their offset is a word index into the block's register page
+static bool sp_ioctl_is_reg_access(unsigned int cmd)
+{
+	switch (cmd) {
+		case SP_IOCTL_AUDIO_READ:
+		case SP_IOCTL_AUDIO_WRITE:
+		case SP_IOCTL_VIDEO_READ:
+		case SP_IOCTL_VIDEO_WRITE:
+		case SP_IOCTL_PALETTE_READ:
+		case SP_IOCTL_PALETTE_WRITE:
+		case SP_IOCTL_VCP_READ:
+		case SP_IOCTL_VCP_WRITE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Commands that carry their own argument layout, returns -ENOIOCTLCMD for the SPIoctl based ones
+static long sp_ioctl_extended(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct my_file_data *filedata = (struct my_file_data*)file->private_data;
+	struct my_driver_data *drvdata = filedata->drvdata;
+
+	switch (cmd) {
+		case SP_IOCTL_VPU_SUBMIT:
+			return sp_ioctl_vpu_submit(drvdata, (void __user *)arg, file->f_flags & O_NONBLOCK);
+		case SP_IOCTL_REG_PROGRAM:
+			return sp_ioctl_reg_program(drvdata, (void __user *)arg);
+		case SP_IOCTL_CACHE_SYNC:
+			return sp_ioctl_cache_sync(filedata, (void __user *)arg);
+		case SP_IOCTL_ALLOC:
+			return sp_ioctl_alloc(filedata, (void __user *)arg);
+		case SP_IOCTL_FREE:
+			return sp_ioctl_free(filedata, (void __user *)arg);
+		case SP_IOCTL_EXPORT:
+			return sp_ioctl_export(filedata, (void __user *)arg);
+		case SP_IOCTL_PALETTE_LOAD:
+			return sp_ioctl_palette_load(filedata, (void __user *)arg);
+		case SP_IOCTL_VCP_LOAD:
+			return sp_ioctl_vcp_load(drvdata, (void __user *)arg);
+		case SP_IOCTL_FIFO_STATUS:
+			return sp_ioctl_fifo_status(drvdata, (void __user *)arg);
+		case SP_IOCTL_RING_DOORBELL:
+			queue_work(system_highpri_wq, &drvdata->ring_work);
+			return 0;
+		default:
+			return -ENOIOCTLCMD;
+	}
+}
+
+static const char *sp_ioctl_names[SP_IOCTL_NR_COUNT] = {
+	[_IOC_NR(SP_IOCTL_GET_VIDEO_CTL)]	= "GET_VIDEO_CTL",
+	[_IOC_NR(SP_IOCTL_GET_AUDIO_CTL)]	= "GET_AUDIO_CTL",
+	[_IOC_NR(SP_IOCTL_GET_PALETTE_CTL)]	= "GET_PALETTE_CTL",
+	[_IOC_NR(SP_IOCTL_AUDIO_READ)]		= "AUDIO_READ",
+	[_IOC_NR(SP_IOCTL_AUDIO_WRITE)]		= "AUDIO_WRITE",
+	[_IOC_NR(SP_IOCTL_VIDEO_READ)]		= "VIDEO_READ",
+	[_IOC_NR(SP_IOCTL_VIDEO_WRITE)]		= "VIDEO_WRITE",
+	[_IOC_NR(SP_IOCTL_VCP_READ)]		= "VCP_READ",
+	[_IOC_NR(SP_IOCTL_VCP_WRITE)]		= "VCP_WRITE",
+	[_IOC_NR(SP_IOCTL_PALETTE_READ)]	= "PALETTE_READ",
+	[_IOC_NR(SP_IOCTL_PALETTE_WRITE)]	= "PALETTE_WRITE",
+	[_IOC_NR(SP_IOCTL_GET_VCP_CTL)]		= "GET_VCP_CTL",
+	[_IOC_NR(SP_IOCTL_VPU_SUBMIT)]		= "VPU_SUBMIT",
+	[_IOC_NR(SP_IOCTL_REG_PROGRAM)]		= "REG_PROGRAM",
+	[_IOC_NR(SP_IOCTL_SET_MAP_MODE)]	= "SET_MAP_MODE",
+	[_IOC_NR(SP_IOCTL_CACHE_SYNC)]		= "CACHE_SYNC",
+	[_IOC_NR(SP_IOCTL_SET_EVENT_MASK)]	= "SET_EVENT_MASK",
+	[_IOC_NR(SP_IOCTL_ALLOC)]			= "ALLOC",
+	[_IOC_NR(SP_IOCTL_FREE)]			= "FREE",
+	[_IOC_NR(SP_IOCTL_EXPORT)]			= "EXPORT",
+	[_IOC_NR(SP_IOCTL_PALETTE_LOAD)]	= "PALETTE_LOAD",
+	[_IOC_NR(SP_IOCTL_VCP_LOAD)]		= "VCP_LOAD",
+	[_IOC_NR(SP_IOCTL_RING_DOORBELL)]	= "RING_DOORBELL",
+	[_IOC_NR(SP_IOCTL_FIFO_STATUS)]		= "FIFO_STATUS",
+};
+
+static int sp_debugfs_stats_show(struct seq_file *m, void *unused)
+{
+	struct my_driver_data *drvdata = m->private;
+	static const char *block_names[ERB_Count] = { "audio", "video", "palette", "vcp" };
+	uint32_t i;
+
+	seq_printf(m, "open_clients %u\n", READ_ONCE(drvdata->open_count));
+	seq_printf(m, "mmaps %lld\n", atomic64_read(&drvdata->mmap_count));
+
+	for (i = 0; i < ERB_Count; ++i)
+		seq_printf(m, "fifo_bytes_%s %lld\n", block_names[i], atomic64_read(&drvdata->fifo_bytes[i]));
+
+	for (i = 0; i < SP_IOCTL_NR_COUNT; ++i)
+	{
+		if (sp_ioctl_names[i])
+			seq_printf(m, "ioctl_%s %lld\n", sp_ioctl_names[i], atomic64_read(&drvdata->ioctl_calls[i]));
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sp_debugfs_stats);
+
+// One line per command that has been called, bucket n counts calls that took [2^n, 2^(n+1)) ns
+static int sp_debugfs_latency_show(struct seq_file *m, void *unused)
+{
+	struct my_driver_data *drvdata = m->private;
+	uint32_t i, b, last;
+
+	for (i = 0; i < SP_IOCTL_NR_COUNT; ++i)
+	{
+		if (!sp_ioctl_names[i] || atomic64_read(&drvdata->ioctl_calls[i]) == 0)
+			continue;
+
+		for (last = LATENCY_BUCKETS; last > 0 && atomic64_read(&drvdata->ioctl_latency[i][last - 1]) == 0; --last)
+			;
+
+		seq_printf(m, "%s", sp_ioctl_names[i]);
+		for (b = 0; b < last; ++b)
+			seq_printf(m, " %lld", atomic64_read(&drvdata->ioctl_latency[i][b]));
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sp_debugfs_latency);
+
+static void sp_debugfs_init(struct my_driver_data *drvdata)
+{
+	drvdata->debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+	debugfs_create_file("stats", 0444, drvdata->debugfs, drvdata, &sp_debugfs_stats_fops);
+	debugfs_create_file("latency", 0444, drvdata->debugfs, drvdata, &sp_debugfs_latency_fops);
+}
+
+static long sp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct my_file_data *filedata = (struct my_file_data*)file->private_data;
+    struct my_driver_data *drvdata = filedata->drvdata;
+
+	struct SPIoctl ioctl_data;
+	long ret;
+
+	ret = sp_ioctl_extended(file, cmd, arg);
+	if (ret != -ENOIOCTLCMD)
+	{
+		trace_sandpiper_ioctl(_IOC_NR(cmd), sp_ioctl_block(cmd), 0, 0);
+		return ret;
+	}
+
+	ret = 0;
+
+	// Copy data from user space
+	if (copy_from_user(&ioctl_data, (void __user *)arg, sizeof(ioctl_data)))
+	{
+		trace_sandpiper_ioctl(_IOC_NR(cmd), sp_ioctl_block(cmd), 0, 0);
+		return -EFAULT;
+	}
+
+	// Same bound as SP_IOCTL_REG_PROGRAM, anything past the page would reach other iomem
+	if (sp_ioctl_is_reg_access(cmd) && ioctl_data.offset >= DEVICE_MEMORY_SIZE / sizeof(uint32_t))
+	{
+		trace_sandpiper_ioctl(_IOC_NR(cmd), sp_ioctl_block(cmd), ioctl_data.offset, ioctl_data.value);
+		return -EINVAL;
+	}
+
+    switch (cmd) {
+        case SP_IOCTL_GET_VIDEO_CTL:
+		{
+			ioctl_data.value = (uint32_t)(uintptr_t)drvdata->video_ctl;
+		}
+		break;
+
+		case SP_IOCTL_GET_AUDIO_CTL:
+		{
+			ioctl_data.value = (uint32_t)(uintptr_t)drvdata->audio_ctl;
+		}
+		break;
+
+		case SP_IOCTL_GET_PALETTE_CTL:
+		{
+			ioctl_data.value = (uint32_t)(uintptr_t)drvdata->palette_ctl;
+		}
+		break;
+
+		case SP_IOCTL_GET_VCP_CTL:
+		{
+			ioctl_data.value = (uint32_t)(uintptr_t)drvdata->vcp_ctl;
+		}
+		break;
+
+		case SP_IOCTL_AUDIO_READ:
+		{
+			ioctl_data.value = sp_reg_read(drvdata, ERB_Audio, ioctl_data.offset);
+		}
+		break;
+
+		case SP_IOCTL_AUDIO_WRITE:
+		{
+			if (sp_audio_owned_by_pcm(drvdata))
+			{
+				ret = -EBUSY;
+				break;
+			}
+			mutex_lock(&drvdata->fifo_lock);
+			sp_reg_write(drvdata, ERB_Audio, ioctl_data.offset, ioctl_data.value);
+			mutex_unlock(&drvdata->fifo_lock);
+			atomic64_add(sizeof(uint32_t), &drvdata->fifo_bytes[ERB_Audio]);
+		}
+		break;
+
+		case SP_IOCTL_VIDEO_READ:
+		{
+			ioctl_data.value = sp_reg_read(drvdata, ERB_Video, ioctl_data.offset);
+		}
+		break;
+
+		case SP_IOCTL_VIDEO_WRITE:
+		{
+			// Single words still go through the FIFO lock so they can't split a command another writer is streaming
+			mutex_lock(&drvdata->fifo_lock);
+			sp_reg_write(drvdata, ERB_Video, ioctl_data.offset, ioctl_data.value);
+			mutex_unlock(&drvdata->fifo_lock);
+			atomic64_add(sizeof(uint32_t), &drvdata->fifo_bytes[ERB_Video]);
+		}
+		break;
+
+		case SP_IOCTL_PALETTE_READ:
+		{
+			ioctl_data.value = sp_reg_read(drvdata, ERB_Palette, ioctl_data.offset);
+		}
+		break;
+
+		case SP_IOCTL_PALETTE_WRITE:
+		{
+			sp_reg_write(drvdata, ERB_Palette, ioctl_data.offset, ioctl_data.value);
+			atomic64_add(sizeof(uint32_t), &drvdata->fifo_bytes[ERB_Palette]);
+		}
+		break;
+
+		case SP_IOCTL_VCP_READ:
+		{
+			ioctl_data.value = sp_reg_read(drvdata, ERB_VCP, ioctl_data.offset);
+		}
+		break;
+
+		case SP_IOCTL_VCP_WRITE:
+		{
+			mutex_lock(&drvdata->fifo_lock);
+			sp_reg_write(drvdata, ERB_VCP, ioctl_data.offset, ioctl_data.value);
+			mutex_unlock(&drvdata->fifo_lock);
+			atomic64_add(sizeof(uint32_t), &drvdata->fifo_bytes[ERB_VCP]);
+		}
+		break;
+
+		case SP_IOCTL_SET_MAP_MODE:
+		{
+			if (ioctl_data.value >= EMM_Count)
+			{
+				ret = -EINVAL;
+				break;
+			}
+			filedata->map_mode = ioctl_data.value;
+		}
+		break;
+
+		case SP_IOCTL_SET_EVENT_MASK:
+		{
+			if (ioctl_data.value & ~EVENT_MASK_ALL)
+			{
+				ret = -EINVAL;
+				break;
+			}
+			sp_events_set_mask(filedata, ioctl_data.value);
+		}
+		break;
+
+		default:
+			ret = -ENOTTY;
+		break;
+    }
+
+	trace_sandpiper_ioctl(_IOC_NR(cmd), sp_ioctl_block(cmd), ioctl_data.offset, ioctl_data.value);
+	if (ret)
+		return ret;
+
+	// Copy the ioctl_data structure back to user space
+	if (copy_to_user((void __user *)arg, &ioctl_data, sizeof(ioctl_data)))
+		return -EFAULT;
+
+    return 0;
+}
+
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct my_file_data *filedata = (struct my_file_data*)file->private_data;
+	struct my_driver_data *drvdata = filedata->drvdata;
+	uint32_t nr = _IOC_NR(cmd);
+	u64 start = ktime_get_ns();
+	u64 elapsed;
+	long ret;
+
+	ret = sp_ioctl(file, cmd, arg);
+
+	if (_IOC_TYPE(cmd) == 'k' && nr < SP_IOCTL_NR_COUNT)
+	{
+		elapsed = ktime_get_ns() - start;
+		atomic64_inc(&drvdata->ioctl_calls[nr]);
+		atomic64_inc(&drvdata->ioctl_latency[nr][min_t(uint32_t, elapsed ? ilog2(elapsed) : 0, LATENCY_BUCKETS - 1)]);
+	}
+
+	return ret;
+}
+
+#if IS_ENABLED(CONFIG_IO_URING)
+
+// State of a SP_URING_WAIT_EVENT command, lives in the command's pdu area
+struct sp_uring_wait {
+	struct list_head node;
+	struct io_uring_cmd *ioucmd;	// NULL until the command is cancelable, the timer leaves it alone until then
+	uint32_t mask;
+	uint32_t type;
+	uint64_t timestamp;
+};
+
+static struct sp_uring_wait *sp_uring_wait(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct sp_uring_wait) > sizeof(ioucmd->pdu));
+	return (struct sp_uring_wait *)ioucmd->pdu;
+}
+
+static void sp_uring_event_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct sp_uring_wait *wait = sp_uring_wait(ioucmd);
+
+	io_uring_cmd_done(ioucmd, wait->type, wait->timestamp, issue_flags);
+}
+
+// Called from the event timer, completes every waiter interested in what just happened
+static void sp_uring_events(struct my_driver_data *drvdata, bool vblank_done, bool audio_done)
+{
+	uint32_t happened = (vblank_done ? EVENT_MASK(EET_VBlank) : 0) | (audio_done ? EVENT_MASK(EET_AudioBuffer) : 0);
+	struct sp_uring_wait *wait, *next;
+
+	spin_lock(&drvdata->event_lock);
+	list_for_each_entry_safe(wait, next, &drvdata->uring_waiters, node)
+	{
+		if (!wait->ioucmd || !(wait->mask & happened))
+			continue;
+
+		list_del_init(&wait->node);
+
+		// Vblank wins when both happened on the same tick
+		if (wait->mask & happened & EVENT_MASK(EET_VBlank))
+		{
+			wait->type = EET_VBlank;
+			wait->timestamp = ktime_to_ns(drvdata->vblank_time);
+		}
+		else
+		{
+			wait->type = EET_AudioBuffer;
+			wait->timestamp = ktime_to_ns(drvdata->audio_time);
+		}
+
+		// Completion has to happen in the submitter's task context, not in the timer
+		io_uring_cmd_complete_in_task(wait->ioucmd, sp_uring_event_done);
+	}
+	spin_unlock(&drvdata->event_lock);
+}
+
+static int sp_uring_wait_event(struct my_file_data *filedata, struct io_uring_cmd *ioucmd, const struct SPEventWait *req, unsigned int issue_flags)
+{
+	struct my_driver_data *drvdata = filedata->drvdata;
+	struct sp_uring_wait *wait = sp_uring_wait(ioucmd);
+	unsigned long flags;
+
+	if (req->mask == 0 || (req->mask & ~EVENT_MASK_ALL))
+		return -EINVAL;
+
+	// Starting the event timer takes a mutex, leave that to io-wq
+	if (!READ_ONCE(filedata->events_enabled) && (issue_flags & IO_URING_F_NONBLOCK))
+		return -EAGAIN;
+	sp_events_enable(filedata);
+
+	// The node has to be on the list before a cancel can find the command, and the command has to be
+	// cancelable before the timer may complete it, or completion would race the cancelable bookkeeping
+	INIT_LIST_HEAD(&wait->node);
+	wait->ioucmd = NULL;
+	wait->mask = req->mask;
+
+	spin_lock_irqsave(&drvdata->event_lock, flags);
+	list_add_tail(&wait->node, &drvdata->uring_waiters);
+	spin_unlock_irqrestore(&drvdata->event_lock, flags);
+
+	io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+
+	spin_lock_irqsave(&drvdata->event_lock, flags);
+	wait->ioucmd = ioucmd;
+	spin_unlock_irqrestore(&drvdata->event_lock, flags);
+
+	return -EIOCBQUEUED;
+}
+
+static int sp_uring_cancel(struct my_driver_data *drvdata, struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct sp_uring_wait *wait = sp_uring_wait(ioucmd);
+	unsigned long flags;
+	bool waiting;
+
+	spin_lock_irqsave(&drvdata->event_lock, flags);
+	waiting = !list_empty(&wait->node);
+	list_del_init(&wait->node);
+	spin_unlock_irqrestore(&drvdata->event_lock, flags);
+
+	// A waiter that already left the list is being completed by the timer
+	if (waiting)
+		io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+
+	return 0;
+}
+
+static int dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct my_file_data *filedata = (struct my_file_data*)ioucmd->file->private_data;
+	struct my_driver_data *drvdata = filedata->drvdata;
+	const void *payload = io_uring_sqe_cmd(ioucmd->sqe);
+
+	if (issue_flags & IO_URING_F_CANCEL)
+		return sp_uring_cancel(drvdata, ioucmd, issue_flags);
+
+	switch (ioucmd->cmd_op) {
+		case SP_IOCTL_VPU_SUBMIT:
+		{
+			struct SPSubmit submit;
+
+			// Waiting for FIFO space sleeps, so the submit runs from io-wq instead of the submitting thread
+			if (issue_flags & IO_URING_F_NONBLOCK)
+				return -EAGAIN;
+
+			memcpy(&submit, payload, sizeof(submit));
+			return sp_fifo_submit(drvdata, ERB_Video, (const uint32_t __user *)(uintptr_t)submit.words, submit.count, false);
+		}
+
+		case SP_IOCTL_PALETTE_LOAD:
+		{
+			struct SPPalette palette;
+
+			memcpy(&palette, payload, sizeof(palette));
+
+			// A vblank latch may have to start the event timer first
+			if (palette.latch == EPL_VBlank && !READ_ONCE(filedata->events_enabled) && (issue_flags & IO_URING_F_NONBLOCK))
+				return -EAGAIN;
+
+			return sp_palette_load(filedata, &palette);
+		}
+
+		case SP_IOCTL_VCP_LOAD:
+		{
+			struct SPVCPProgram program;
+
+			if (issue_flags & IO_URING_F_NONBLOCK)
+				return -EAGAIN;
+
+			memcpy(&program, payload, sizeof(program));
+			return sp_vcp_load(drvdata, &program);
+		}
+
+		case SP_URING_WAIT_EVENT:
+		{
+			struct SPEventWait req;
+
+			memcpy(&req, payload, sizeof(req));
+			return sp_uring_wait_event(filedata, ioucmd, &req, issue_flags);
+		}
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+#else
+
+static void sp_uring_events(struct my_driver_data *drvdata, bool vblank_done, bool audio_done)
+{
+}
+
+#endif
+
+static int dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct my_file_data *filedata = (struct my_file_data*)file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long physical_addr = 0;
+	bool is_register_page = false;
+	bool is_command_ring = false;
+	bool is_status_page = false;
+
+	if (offset == PHYS_ADDR)
+	{
+		physical_addr = PHYS_ADDR;
+		if (size > RESERVED_MEMORY_SIZE)
+		{
+			printk(KERN_INFO "%s: mmap request exceeds memory region\n", DEVICE_NAME);
+			return -EINVAL;
+		}
+
+		// Past the console framebuffer lie other clients' allocations and the driver's own ring, status page,
+		// PCM buffer and VCP slots, so a writable view of all of it is for trusted clients only
+		if (size > PAGE_ALIGN(CONSOLE_FRAMEBUFFER_SIZE) && !capable(CAP_SYS_RAWIO))
+			return -EPERM;
+	}
+	else if (offset == COMMAND_RING_ADDR)
+	{
+		// The one shared ring feeds every command FIFO, so it gets the same protection as the register pages
+		if (!capable(CAP_SYS_RAWIO))
+			return -EPERM;
+
+		// Producers use atomics on the ring, which needs a cacheable mapping whatever the map mode
+		physical_addr = COMMAND_RING_ADDR;
+		is_command_ring = true;
+		if (size > PAGE_ALIGN(COMMAND_RING_SIZE))
+		{
+			printk(KERN_INFO "%s: mmap request exceeds command ring\n", DEVICE_NAME);
+			return -EINVAL;
+		}
+	}
+	else if (offset == STATUS_PAGE_ADDR)
+	{
+		// Readers poll the page, nothing may be written back through the mapping
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vm_flags_clear(vma, VM_MAYWRITE);
+
+		physical_addr = STATUS_PAGE_ADDR;
+		is_status_page = true;
+		if (size > PAGE_SIZE)
+		{
+			printk(KERN_INFO "%s: mmap request exceeds status page\n", DEVICE_NAME);
+			return -EINVAL;
+		}
+
+		// The page is only kept current while the event timer runs
+		sp_events_enable(filedata);
+	}
+	else if (offset == AUDIO_CTRL_REGS_ADDR || offset == VIDEO_CTRL_REGS_ADDR || offset == PALETTE_CTRL_REGS_ADDR || offset == VCP_CTRL_REGS_ADDR)
+	{
+		// Direct register access bypasses the driver entirely, so only trusted clients get it
+		if (!capable(CAP_SYS_RAWIO))
+			return -EPERM;
+
+		physical_addr = offset;
+		is_register_page = true;
+		if (size > DEVICE_MEMORY_SIZE)
+		{
+			printk(KERN_INFO "%s: mmap request exceeds control register page\n", DEVICE_NAME);
+			return -EINVAL;
+		}
 	}
+	else if (sp_file_owns_range(filedata, offset, size))
+	{
+		// Allocation handed out by SP_IOCTL_ALLOC on this file
+		physical_addr = offset;
+	}
+	else
+	{
+		printk(KERN_INFO "%s: invalid mmap offset 0x%lx\n", DEVICE_NAME, offset);
+		return -EINVAL;
+	}
+
+	// Control registers are mapped as device memory so stores reach the FIFOs in program order
+	if (is_register_page)
+		vma->vm_page_prot = pgprot_device(vma->vm_page_prot);
+	else if (filedata->map_mode == EMM_WriteCombine && !is_command_ring && !is_status_page)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	else if (filedata->map_mode == EMM_Uncached && !is_command_ring && !is_status_page)
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	// EMM_Cached, the command ring and the status page keep the default cacheable protection
+
+	if (remap_pfn_range(vma, vma->vm_start, physical_addr >> PAGE_SHIFT, size, vma->vm_page_prot))
+	{
+		printk(KERN_INFO "%s: failed to remap page\n", DEVICE_NAME);
+		return -EAGAIN;
+	}
+
+	trace_sandpiper_mmap(physical_addr, size, filedata->map_mode);
+	atomic64_inc(&filedata->drvdata->mmap_count);
 
 	//printk(KERN_INFO "%s: mmap successful, mapped physical address 0x%lx to virtual address 0x%x\n", DEVICE_NAME, physical_addr, (uint32_t)vma->vm_start);
 
@@ -450,6 +3605,11 @@ static void __exit sandpiper_exit(void)
 module_init(sandpiper_init);
 module_exit(sandpiper_exit);
 
+#if IS_ENABLED(CONFIG_SANDPIPER_KUNIT_TEST)
+#include "sandpiper_test.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Engin Cilasun");
 MODULE_DESCRIPTION("platform driver for sandpiper");
+MODULE_IMPORT_NS(DMA_BUF);
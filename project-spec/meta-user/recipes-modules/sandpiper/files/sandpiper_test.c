@@ -0,0 +1,618 @@
+// KUnit suite for the sandpiper driver, included at the end of sandpiper.c when CONFIG_SANDPIPER_KUNIT_TEST is set
+// The driver runs on a fake register backend that logs every write, so command streams can be checked word by word
+// without the fabric. See the README for running it.
+
+#include <kunit/test.h>
+#include <kunit/resource.h>
+#include <linux/anon_inodes.h>
+#include <linux/mman.h>
+#include <linux/vmalloc.h>
+
+#define SP_TEST_LOG_MAX		256
+// User buffers live below 4G so they fit the 32 bit pointers of the ioctl ABI
+#define SP_TEST_USER_ADDR	0x10000000
+#define SP_TEST_USER_SIZE	0x40000
+
+struct sp_test_write {
+	uint32_t block;
+	uint32_t offset;
+	uint32_t value;
+};
+
+// Fake register backend, reads come from regs and every write is logged in order
+struct sp_test_fake {
+	uint32_t regs[ERB_Count][DEVICE_MEMORY_SIZE / sizeof(uint32_t)];
+	struct sp_test_write log[SP_TEST_LOG_MAX];
+	uint32_t writes;				// Total writes, only the first SP_TEST_LOG_MAX are logged
+};
+
+struct sp_test_ctx {
+	struct sp_test_fake fake;
+	struct my_driver_data *drvdata;
+	struct inode inode;
+	unsigned long user;				// Base of the user buffer area
+	unsigned long user_used;
+};
+
+// Backend callbacks only get drvdata, tests run one at a time so a single current fake is enough
+static struct sp_test_fake *sp_test_current;
+
+static uint32_t sp_fake_read(struct my_driver_data *drvdata, uint32_t block, uint32_t offset)
+{
+	return sp_test_current->regs[block][offset];
+}
+
+static void sp_fake_write(struct my_driver_data *drvdata, uint32_t block, uint32_t offset, uint32_t value)
+{
+	struct sp_test_fake *fake = sp_test_current;
+
+	if (fake->writes < SP_TEST_LOG_MAX)
+	{
+		fake->log[fake->writes].block = block;
+		fake->log[fake->writes].offset = offset;
+		fake->log[fake->writes].value = value;
+	}
+	fake->writes++;
+
+	// The palette block is plain registers, FIFO writes don't change what reads return
+	if (block == ERB_Palette)
+		fake->regs[block][offset] = value;
+}
+
+static void sp_fake_write_rep(struct my_driver_data *drvdata, uint32_t block, const uint32_t *words, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; ++i)
+		sp_fake_write(drvdata, block, 0, words[i]);
+}
+
+static const struct sp_reg_ops sp_fake_reg_ops = {
+	.read = sp_fake_read,
+	.write = sp_fake_write,
+	.write_rep = sp_fake_write_rep,
+};
+
+static void sp_test_vfree(void *mem)
+{
+	vfree(mem);
+}
+
+static void sp_test_fput(void *file)
+{
+	fput(file);
+}
+
+static void sp_test_release(void *data)
+{
+	struct file *file = data;
+
+	dev_release(file->f_inode, file);
+}
+
+static int sp_test_init(struct kunit *test)
+{
+	struct sp_test_ctx *ctx;
+	struct my_driver_data *drvdata;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	drvdata = kunit_kzalloc(test, sizeof(*drvdata), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, drvdata);
+
+	sp_test_current = &ctx->fake;
+	sp_drvdata_init(drvdata, &sp_fake_reg_ops);
+
+	drvdata->shared_mem = vzalloc(RESERVED_MEMORY_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, drvdata->shared_mem);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, sp_test_vfree, drvdata->shared_mem), 0);
+
+	sp_ring_init(drvdata);
+	sp_status_init(drvdata);
+
+	ctx->drvdata = drvdata;
+	ctx->inode.i_cdev = &drvdata->cdev;
+
+	ctx->user = kunit_vm_mmap(test, NULL, SP_TEST_USER_ADDR, SP_TEST_USER_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE, 0);
+	KUNIT_ASSERT_EQ(test, ctx->user, (unsigned long)SP_TEST_USER_ADDR);
+
+	test->priv = ctx;
+
+	return 0;
+}
+
+static void sp_test_exit(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+
+	cancel_work_sync(&ctx->drvdata->ring_work);
+}
+
+// Open the device the way the character device would, the file is released when the test ends
+static struct file *sp_test_open(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file;
+
+	file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, file);
+	file->f_inode = &ctx->inode;
+
+	KUNIT_ASSERT_EQ(test, dev_open(&ctx->inode, file), 0);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, sp_test_release, file), 0);
+
+	return file;
+}
+
+static void sp_test_close(struct kunit *test, struct file *file)
+{
+	kunit_release_action(test, sp_test_release, file);
+}
+
+// Copy data into the user buffer area and return its 32 bit user address
+static uint32_t sp_test_user(struct kunit *test, const void *data, size_t size)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	unsigned long addr = ctx->user + ctx->user_used;
+
+	KUNIT_ASSERT_LE(test, ctx->user_used + size, (unsigned long)SP_TEST_USER_SIZE);
+	KUNIT_ASSERT_EQ(test, copy_to_user((void __user *)addr, data, size), 0UL);
+	ctx->user_used += ALIGN(size, 8);
+
+	return addr;
+}
+
+static void sp_test_user_read(struct kunit *test, void *data, uint32_t addr, size_t size)
+{
+	KUNIT_ASSERT_EQ(test, copy_from_user(data, (const void __user *)(uintptr_t)addr, size), 0UL);
+}
+
+static void sp_test_expect_writes(struct kunit *test, uint32_t first, uint32_t block, uint32_t offset, const uint32_t *values, uint32_t count)
+{
+	struct sp_test_fake *fake = &((struct sp_test_ctx *)test->priv)->fake;
+	uint32_t i;
+
+	KUNIT_ASSERT_LE(test, first + count, min_t(uint32_t, fake->writes, SP_TEST_LOG_MAX));
+	for (i = 0; i < count; ++i)
+	{
+		KUNIT_EXPECT_EQ_MSG(test, fake->log[first + i].block, block, "write %u", first + i);
+		KUNIT_EXPECT_EQ_MSG(test, fake->log[first + i].offset, offset, "write %u", first + i);
+		KUNIT_EXPECT_EQ_MSG(test, fake->log[first + i].value, values[i], "write %u", first + i);
+	}
+}
+
+// Submits longer than one kernel side chunk reach the video FIFO unbroken and in order
+static void sp_test_vpu_submit(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	uint32_t words[SUBMIT_CHUNK_WORDS + 36];
+	struct SPSubmit submit;
+	uint32_t i;
+
+	for (i = 0; i < ARRAY_SIZE(words); ++i)
+		words[i] = 0x1000 + i;
+	submit.count = ARRAY_SIZE(words);
+	submit.words = sp_test_user(test, words, sizeof(words));
+
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VPU_SUBMIT, sp_test_user(test, &submit, sizeof(submit))), 0L);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, (uint32_t)ARRAY_SIZE(words));
+	sp_test_expect_writes(test, 0, ERB_Video, 0, words, ARRAY_SIZE(words));
+	KUNIT_EXPECT_EQ(test, atomic64_read(&ctx->drvdata->fifo_bytes[ERB_Video]), (s64)sizeof(words));
+
+	// A bad word pointer fails before anything reaches the FIFO
+	ctx->fake.writes = 0;
+	submit.words = 0;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VPU_SUBMIT, sp_test_user(test, &submit, sizeof(submit))), (long)-EFAULT);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+}
+
+// Non-blocking submits longer than the FIFO only fail when the fill level is actually watched
+static void sp_test_vpu_submit_nonblock(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	bool backpressure = fifo_backpressure;
+	uint32_t count = FIFO_DEPTH_WORDS + 1;
+	struct SPSubmit submit;
+	uint32_t *words;
+	uint32_t arg;
+
+	words = kunit_kzalloc(test, count * sizeof(uint32_t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, words);
+
+	file->f_flags |= O_NONBLOCK;
+	submit.count = count;
+	submit.words = sp_test_user(test, words, count * sizeof(uint32_t));
+	arg = sp_test_user(test, &submit, sizeof(submit));
+
+	fifo_backpressure = false;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VPU_SUBMIT, arg), 0L);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, count);
+
+	// With backpressure on, the list can never fit, and it does not count as the FIFO overflowing
+	ctx->fake.writes = 0;
+	fifo_backpressure = true;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VPU_SUBMIT, arg), (long)-EINVAL);
+	fifo_backpressure = backpressure;
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+	KUNIT_EXPECT_EQ(test, ctx->drvdata->fifo_overflows[ERB_Video], 0u);
+}
+
+static void sp_test_reg_program(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	struct SPRegOp ops[3] = {
+		{ .block = ERB_Video, .offset = 0, .value = VPUCMD_SYNCSWAP, .op = ERO_Write },
+		{ .block = ERB_Palette, .offset = 5, .value = 0x12, .op = ERO_MaskWrite, .mask = 0xFF },
+		{ .block = ERB_VCP, .offset = VCP_STATUS_OFFSET, .op = ERO_Read },
+	};
+	const uint32_t video[] = { VPUCMD_SYNCSWAP };
+	const uint32_t palette[] = { 0xFF0012 };
+	struct SPRegProgram program;
+
+	ctx->fake.regs[ERB_Palette][5] = 0xFF00FF;
+	ctx->fake.regs[ERB_VCP][VCP_STATUS_OFFSET] = 0x55;
+
+	program.count = ARRAY_SIZE(ops);
+	program.ops = sp_test_user(test, ops, sizeof(ops));
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_REG_PROGRAM, sp_test_user(test, &program, sizeof(program))), 0L);
+
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 2u);
+	sp_test_expect_writes(test, 0, ERB_Video, 0, video, 1);
+	sp_test_expect_writes(test, 1, ERB_Palette, 5, palette, 1);
+
+	// Mask writes hand back the previous value, reads the register
+	sp_test_user_read(test, ops, program.ops, sizeof(ops));
+	KUNIT_EXPECT_EQ(test, ops[1].value, 0xFF00FFu);
+	KUNIT_EXPECT_EQ(test, ops[2].value, 0x55u);
+
+	// One bad op rejects the whole chunk before any register is touched
+	ctx->fake.writes = 0;
+	ops[2].offset = DEVICE_MEMORY_SIZE / sizeof(uint32_t);
+	program.ops = sp_test_user(test, ops, sizeof(ops));
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_REG_PROGRAM, sp_test_user(test, &program, sizeof(program))), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+}
+
+static void sp_test_vcp_load(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	const uint32_t code[] = { 0x11111111, 0x22222222, 0x33333333, 0x44444444 };
+	const uint32_t first[] = { VCPSETBUFFERSIZE, ARRAY_SIZE(code), VCPSTARTDMA, VCP_PROGRAM_ADDR, VCPEXEC | 0x10 };
+	const uint32_t second[] = { VCPSETBUFFERSIZE, ARRAY_SIZE(code), VCPSTARTDMA, VCP_PROGRAM_ADDR + VCP_PROGRAM_SLOT_SIZE, VCPEXEC };
+	struct SPVCPProgram program;
+
+	program.size = sizeof(code);
+	program.program = sp_test_user(test, code, sizeof(code));
+	program.execflags = 0x10;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VCP_LOAD, sp_test_user(test, &program, sizeof(program))), 0L);
+	KUNIT_EXPECT_MEMEQ(test, ctx->drvdata->shared_mem + (VCP_PROGRAM_ADDR - PHYS_ADDR), code, sizeof(code));
+
+	// Back to back loads alternate staging slots so the VCP never fetches a program being overwritten
+	program.execflags = 0;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VCP_LOAD, sp_test_user(test, &program, sizeof(program))), 0L);
+
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 10u);
+	sp_test_expect_writes(test, 0, ERB_VCP, 0, first, ARRAY_SIZE(first));
+	sp_test_expect_writes(test, 5, ERB_VCP, 0, second, ARRAY_SIZE(second));
+
+	// Flags reaching into the opcode are refused
+	ctx->fake.writes = 0;
+	program.execflags = VCPEXEC;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VCP_LOAD, sp_test_user(test, &program, sizeof(program))), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+}
+
+static void sp_test_palette_load(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	const uint32_t entries[] = { 0x000000, 0xFF0000, 0x00FF00 };
+	struct SPPalette palette;
+
+	palette.first = 10;
+	palette.count = ARRAY_SIZE(entries);
+	palette.entries = sp_test_user(test, entries, sizeof(entries));
+	palette.latch = EPL_Immediate;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_PALETTE_LOAD, sp_test_user(test, &palette, sizeof(palette))), 0L);
+
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 3u);
+	KUNIT_EXPECT_EQ(test, ctx->fake.regs[ERB_Palette][10], entries[0]);
+	KUNIT_EXPECT_EQ(test, ctx->fake.regs[ERB_Palette][11], entries[1]);
+	KUNIT_EXPECT_EQ(test, ctx->fake.regs[ERB_Palette][12], entries[2]);
+
+	// Vblank latched entries are held back until the event timer sees the vblank counter move
+	ctx->fake.writes = 0;
+	palette.first = 20;
+	palette.latch = EPL_VBlank;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_PALETTE_LOAD, sp_test_user(test, &palette, sizeof(palette))), 0L);
+	hrtimer_cancel(&ctx->drvdata->event_timer);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+
+	ctx->fake.regs[ERB_Video][VIDEO_STATUS_OFFSET]++;
+	sp_event_timer(&ctx->drvdata->event_timer);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 3u);
+	KUNIT_EXPECT_EQ(test, ctx->fake.regs[ERB_Palette][20], entries[0]);
+	KUNIT_EXPECT_EQ(test, ctx->fake.regs[ERB_Palette][22], entries[2]);
+}
+
+static void sp_test_ring_drain(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct SPRingHeader *header = sp_ring_header(ctx->drvdata);
+	struct SPRingEntry *entries = (void *)header + PAGE_SIZE;
+	const uint32_t blocks[] = { ERB_Video, ERB_Palette, ERB_VCP, ERB_Audio, ERB_Video };
+	uint32_t i;
+
+	// Publish four entries, the fifth is filled in but not published yet
+	for (i = 0; i < ARRAY_SIZE(blocks); ++i)
+	{
+		entries[i].block = blocks[i];
+		entries[i].word = 0xA0 + i;
+		entries[i].sequence = i < 4 ? i + 1 : 0;
+	}
+	header->head = ARRAY_SIZE(blocks);
+
+	sp_ring_work(&ctx->drvdata->ring_work);
+
+	// The palette entry has no FIFO behind it, it is counted and skipped
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 3u);
+	sp_test_expect_writes(test, 0, ERB_Video, 0, (const uint32_t[]){ 0xA0 }, 1);
+	sp_test_expect_writes(test, 1, ERB_VCP, 0, (const uint32_t[]){ 0xA2 }, 1);
+	sp_test_expect_writes(test, 2, ERB_Audio, 0, (const uint32_t[]){ 0xA3 }, 1);
+	KUNIT_EXPECT_EQ(test, header->errors, 1u);
+	KUNIT_EXPECT_EQ(test, header->tail, 4u);
+
+	// Publishing the last entry and draining again picks up where the driver stopped
+	entries[4].sequence = 5;
+	sp_ring_work(&ctx->drvdata->ring_work);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 4u);
+	sp_test_expect_writes(test, 3, ERB_Video, 0, (const uint32_t[]){ 0xA4 }, 1);
+	KUNIT_EXPECT_EQ(test, header->tail, 5u);
+}
+
+// The last close puts every unit back into the state the console expects
+static void sp_test_release_reset(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *first = sp_test_open(test);
+	struct file *second = sp_test_open(test);
+	const uint32_t video[] = {
+		VPUCMD_SETVPAGE, CONSOLE_FRAMEBUFFER_ADDR,
+		VPUCMD_SETVMODE, MAKEVMODEINFO((uint32_t)ECM_16bit_RGB, (uint32_t)EVM_640_Wide, (uint32_t)EVS_Enable),
+		VPUCMD_WCONTROLREG | 0,
+		VPUCMD_SHIFTCACHE, 0,
+		VPUCMD_SHIFTSCANOUT, 0,
+		VPUCMD_SHIFTPIXEL, 0,
+	};
+	const uint32_t audio[] = { APUCMD_SETRATE, ASR_Halt };
+	const uint32_t vcp[] = { VCPEXEC | 0 };
+	struct SPRingHeader *header = sp_ring_header(ctx->drvdata);
+	struct SPRingEntry *entries = (void *)header + PAGE_SIZE;
+
+	sp_test_close(test, first);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+
+	// Two entries reserved, only the first published, as a producer that died half way would leave them
+	entries[0].block = ERB_Video;
+	entries[0].word = VPUCMD_SYNCSWAP;
+	entries[0].sequence = 1;
+	header->head = 2;
+
+	sp_test_close(test, second);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, (uint32_t)(ARRAY_SIZE(video) + ARRAY_SIZE(audio) + ARRAY_SIZE(vcp)));
+	sp_test_expect_writes(test, 0, ERB_Video, 0, video, ARRAY_SIZE(video));
+	sp_test_expect_writes(test, ARRAY_SIZE(video), ERB_Audio, 0, audio, ARRAY_SIZE(audio));
+	sp_test_expect_writes(test, ARRAY_SIZE(video) + ARRAY_SIZE(audio), ERB_VCP, 0, vcp, ARRAY_SIZE(vcp));
+
+	// The next client starts on an empty ring
+	KUNIT_EXPECT_EQ(test, header->head, 0u);
+	KUNIT_EXPECT_EQ(test, header->tail, 0u);
+	KUNIT_EXPECT_EQ(test, entries[0].sequence, 0u);
+	KUNIT_EXPECT_EQ(test, header->entries, (uint32_t)COMMAND_RING_ENTRIES);
+}
+
+// Units owned by someone else are left alone on the last close
+static void sp_test_release_owned(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	const uint32_t vcp[] = { VCPEXEC | 0 };
+	struct uio_info info = { .name = "sandpiper-test" };
+
+	ctx->drvdata->drm_active = true;
+	ctx->drvdata->pcm_running = true;
+	sp_test_close(test, file);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 1u);
+	sp_test_expect_writes(test, 0, ERB_VCP, 0, vcp, 1);
+
+	// With the UIO binding a userspace driver owns all of them
+	ctx->fake.writes = 0;
+	ctx->drvdata->uio_info = &info;
+	file = sp_test_open(test);
+	sp_test_close(test, file);
+	ctx->drvdata->uio_info = NULL;
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+}
+
+// Legacy single register access stays inside the block's register page
+static void sp_test_legacy_offset(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	struct SPIoctl data = { .offset = DEVICE_MEMORY_SIZE / sizeof(uint32_t), .value = 1 };
+	uint32_t arg = sp_test_user(test, &data, sizeof(data));
+
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_PALETTE_WRITE, arg), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_PALETTE_READ, arg), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VIDEO_WRITE, arg), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_VCP_READ, arg), (long)-EINVAL);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+
+	// The last word of the page is fine
+	data.offset = DEVICE_MEMORY_SIZE / sizeof(uint32_t) - 1;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_PALETTE_WRITE, sp_test_user(test, &data, sizeof(data))), 0L);
+	KUNIT_EXPECT_EQ(test, ctx->fake.regs[ERB_Palette][DEVICE_MEMORY_SIZE / sizeof(uint32_t) - 1], 1u);
+}
+
+// User space may not split the APU command pairs ALSA writes while it has a substream open
+static void sp_test_audio_owned_by_pcm(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	struct SPIoctl data = { .offset = 0, .value = APUCMD_NOOP };
+	struct snd_pcm_substream *substream;
+
+	// Ownership only looks at the pointer, so an empty substream stands in for an open ALSA stream
+	substream = kunit_kzalloc(test, sizeof(*substream), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, substream);
+
+	ctx->drvdata->pcm_substream = substream;
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_AUDIO_WRITE, sp_test_user(test, &data, sizeof(data))), (long)-EBUSY);
+	ctx->drvdata->pcm_substream = NULL;
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 0u);
+
+	KUNIT_EXPECT_EQ(test, dev_ioctl(file, SP_IOCTL_AUDIO_WRITE, sp_test_user(test, &data, sizeof(data))), 0L);
+	sp_test_expect_writes(test, 0, ERB_Audio, 0, &data.value, 1);
+}
+
+#if IS_REACHABLE(CONFIG_SND_PCM)
+// Each finished buffer queues the period after the next one, the next one is already waiting in the APU
+static void sp_test_pcm_queue_ahead(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct my_driver_data *drvdata = ctx->drvdata;
+	const uint32_t queued[] = { APUCMD_START, PCM_BUFFER_ADDR + 2 * 1024, APUCMD_START, PCM_BUFFER_ADDR + 3 * 1024, APUCMD_START, PCM_BUFFER_ADDR };
+
+	drvdata->pcm_period_bytes = 1024;
+	drvdata->pcm_periods = 4;
+	drvdata->pcm_playing = 0;
+	drvdata->pcm_running = true;
+
+	sp_pcm_buffer_done(drvdata);
+	sp_pcm_buffer_done(drvdata);
+	sp_pcm_buffer_done(drvdata);
+
+	KUNIT_EXPECT_EQ(test, drvdata->pcm_playing, 3u);
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, (uint32_t)ARRAY_SIZE(queued));
+	sp_test_expect_writes(test, 0, ERB_Audio, 0, queued, ARRAY_SIZE(queued));
+}
+#endif
+
+static void sp_test_owns_range(struct kunit *test)
+{
+	struct my_file_data *filedata;
+	struct sp_allocation *alloc;
+	unsigned long base = POOL_MEMORY_ADDR + 4 * PAGE_SIZE;
+
+	filedata = kunit_kzalloc(test, sizeof(*filedata), GFP_KERNEL);
+	alloc = kunit_kzalloc(test, sizeof(*alloc), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, filedata);
+	KUNIT_ASSERT_NOT_NULL(test, alloc);
+	mutex_init(&filedata->alloc_lock);
+	INIT_LIST_HEAD(&filedata->allocs);
+	alloc->paddr = base;
+	alloc->size = 2 * PAGE_SIZE;
+	list_add(&alloc->node, &filedata->allocs);
+
+	KUNIT_EXPECT_TRUE(test, sp_file_owns_range(filedata, base, 2 * PAGE_SIZE));
+	KUNIT_EXPECT_TRUE(test, sp_file_owns_range(filedata, base + PAGE_SIZE, PAGE_SIZE));
+	KUNIT_EXPECT_FALSE(test, sp_file_owns_range(filedata, base + PAGE_SIZE, 2 * PAGE_SIZE));
+	KUNIT_EXPECT_FALSE(test, sp_file_owns_range(filedata, base - PAGE_SIZE, PAGE_SIZE));
+
+	// Past the end of the allocation, where the remaining length would wrap
+	KUNIT_EXPECT_FALSE(test, sp_file_owns_range(filedata, base + 2 * PAGE_SIZE, PAGE_SIZE));
+	KUNIT_EXPECT_FALSE(test, sp_file_owns_range(filedata, base + 16 * PAGE_SIZE, PAGE_SIZE));
+}
+
+static const struct file_operations sp_test_mmap_fops = {
+	.owner = THIS_MODULE,
+	.mmap = dev_mmap,
+};
+
+// kunit_vm_mmap only tells success from failure, the register page mapping shows failures come from dev_mmap
+static void sp_test_mmap(struct kunit *test)
+{
+	struct file *file = sp_test_open(test);
+	struct file *mapfile;
+
+	mapfile = anon_inode_getfile("sandpiper-test", &sp_test_mmap_fops, file->private_data, O_RDWR);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(mapfile));
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, sp_test_fput, mapfile), 0);
+
+	KUNIT_EXPECT_NE(test, kunit_vm_mmap(test, mapfile, 0, DEVICE_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, VIDEO_CTRL_REGS_ADDR), 0UL);
+
+	KUNIT_EXPECT_EQ(test, kunit_vm_mmap(test, mapfile, 0, 2 * DEVICE_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, VIDEO_CTRL_REGS_ADDR), 0UL);
+	KUNIT_EXPECT_EQ(test, kunit_vm_mmap(test, mapfile, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, STATUS_PAGE_ADDR), 0UL);
+	KUNIT_EXPECT_EQ(test, kunit_vm_mmap(test, mapfile, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, POOL_MEMORY_ADDR), 0UL);
+	KUNIT_EXPECT_EQ(test, kunit_vm_mmap(test, mapfile, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, PHYS_ADDR + PAGE_SIZE), 0UL);
+}
+
+// Cost of the ioctl dispatch path on the fake backend, single register writes against the same words in one submit
+// Timings depend on the host, so they are only reported, the checks are on the words and the call counts
+static void sp_test_ioctl_timing(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+	struct file *file = sp_test_open(test);
+	const uint32_t count = 4096;
+	struct SPIoctl data = { .offset = 0, .value = VPUCMD_NOOP };
+	uint32_t words[SUBMIT_CHUNK_WORDS];
+	struct SPSubmit submit;
+	uint32_t arg, i;
+	u64 start, single, batched;
+
+	arg = sp_test_user(test, &data, sizeof(data));
+	start = ktime_get_ns();
+	for (i = 0; i < count; ++i)
+		dev_ioctl(file, SP_IOCTL_VIDEO_WRITE, arg);
+	single = ktime_get_ns() - start;
+
+	for (i = 0; i < ARRAY_SIZE(words); ++i)
+		words[i] = VPUCMD_NOOP;
+	submit.count = ARRAY_SIZE(words);
+	submit.words = sp_test_user(test, words, sizeof(words));
+	arg = sp_test_user(test, &submit, sizeof(submit));
+	start = ktime_get_ns();
+	for (i = 0; i < count / ARRAY_SIZE(words); ++i)
+		dev_ioctl(file, SP_IOCTL_VPU_SUBMIT, arg);
+	batched = ktime_get_ns() - start;
+
+	kunit_info(test, "VIDEO_WRITE %llu ns per word, VPU_SUBMIT of %zu %llu ns per word\n",
+		div_u64(single, count), ARRAY_SIZE(words), div_u64(batched, count));
+
+	KUNIT_EXPECT_EQ(test, ctx->fake.writes, 2 * count);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&ctx->drvdata->ioctl_calls[_IOC_NR(SP_IOCTL_VIDEO_WRITE)]), (s64)count);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&ctx->drvdata->ioctl_calls[_IOC_NR(SP_IOCTL_VPU_SUBMIT)]), (s64)(count / ARRAY_SIZE(words)));
+}
+
+static struct kunit_case sp_test_cases[] = {
+	KUNIT_CASE(sp_test_vpu_submit),
+	KUNIT_CASE(sp_test_vpu_submit_nonblock),
+	KUNIT_CASE(sp_test_reg_program),
+	KUNIT_CASE(sp_test_vcp_load),
+	KUNIT_CASE(sp_test_palette_load),
+	KUNIT_CASE(sp_test_ring_drain),
+	KUNIT_CASE(sp_test_release_reset),
+	KUNIT_CASE(sp_test_release_owned),
+	KUNIT_CASE(sp_test_legacy_offset),
+	KUNIT_CASE(sp_test_audio_owned_by_pcm),
+#if IS_REACHABLE(CONFIG_SND_PCM)
+	KUNIT_CASE(sp_test_pcm_queue_ahead),
+#endif
+	KUNIT_CASE(sp_test_owns_range),
+	KUNIT_CASE(sp_test_mmap),
+	KUNIT_CASE(sp_test_ioctl_timing),
+	{}
+};
+
+static struct kunit_suite sp_test_suite = {
+	.name = "sandpiper",
+	.init = sp_test_init,
+	.exit = sp_test_exit,
+	.test_cases = sp_test_cases,
+};
+
+kunit_test_suite(sp_test_suite);
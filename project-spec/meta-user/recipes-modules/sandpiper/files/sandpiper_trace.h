@@ -0,0 +1,95 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sandpiper
+
+#if !defined(_SANDPIPER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SANDPIPER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Register blocks, matches ERegisterBlock in sandpiper.c
+#define show_sandpiper_block(_block)		\
+	__print_symbolic(_block,				\
+		{ 0, "audio" },						\
+		{ 1, "video" },						\
+		{ 2, "palette" },					\
+		{ 3, "vcp" },						\
+		{ 4, "none" })
+
+// One ioctl, offset and value are the SPIoctl fields for the single register commands and zero otherwise
+TRACE_EVENT(sandpiper_ioctl,
+	TP_PROTO(uint32_t nr, uint32_t block, uint32_t offset, uint32_t value),
+	TP_ARGS(nr, block, offset, value),
+	TP_STRUCT__entry(
+		__field(uint32_t, nr)
+		__field(uint32_t, block)
+		__field(uint32_t, offset)
+		__field(uint32_t, value)
+	),
+	TP_fast_assign(
+		__entry->nr = nr;
+		__entry->block = block;
+		__entry->offset = offset;
+		__entry->value = value;
+	),
+	TP_printk("nr=%u block=%s offset=0x%x value=0x%08x",
+		__entry->nr, show_sandpiper_block(__entry->block), __entry->offset, __entry->value)
+);
+
+// One word written to a command FIFO or register
+TRACE_EVENT(sandpiper_fifo_write,
+	TP_PROTO(uint32_t block, uint32_t offset, uint32_t value),
+	TP_ARGS(block, offset, value),
+	TP_STRUCT__entry(
+		__field(uint32_t, block)
+		__field(uint32_t, offset)
+		__field(uint32_t, value)
+	),
+	TP_fast_assign(
+		__entry->block = block;
+		__entry->offset = offset;
+		__entry->value = value;
+	),
+	TP_printk("block=%s offset=0x%x value=0x%08x",
+		show_sandpiper_block(__entry->block), __entry->offset, __entry->value)
+);
+
+TRACE_EVENT(sandpiper_mmap,
+	TP_PROTO(unsigned long addr, unsigned long size, uint32_t map_mode),
+	TP_ARGS(addr, size, map_mode),
+	TP_STRUCT__entry(
+		__field(unsigned long, addr)
+		__field(unsigned long, size)
+		__field(uint32_t, map_mode)
+	),
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->size = size;
+		__entry->map_mode = map_mode;
+	),
+	TP_printk("addr=0x%lx size=0x%lx map_mode=%u",
+		__entry->addr, __entry->size, __entry->map_mode)
+);
+
+// Last close of the device, reset is false for units left alone because DRM or ALSA owns them
+TRACE_EVENT(sandpiper_teardown,
+	TP_PROTO(uint32_t block, bool reset),
+	TP_ARGS(block, reset),
+	TP_STRUCT__entry(
+		__field(uint32_t, block)
+		__field(bool, reset)
+	),
+	TP_fast_assign(
+		__entry->block = block;
+		__entry->reset = reset;
+	),
+	TP_printk("block=%s %s",
+		show_sandpiper_block(__entry->block), __entry->reset ? "reset" : "kept")
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sandpiper_trace
+#include <trace/define_trace.h>
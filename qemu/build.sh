@@ -0,0 +1,6 @@
+QEMU_VERSION=v9.2.0
+if [ ! -d src ]; then git clone --depth 1 --branch $QEMU_VERSION https://gitlab.com/qemu-project/qemu.git src; fi
+cp sandpiper.c src/hw/display/sandpiper.c
+grep -q sandpiper.c src/hw/display/meson.build || echo "system_ss.add(when: 'CONFIG_ZYNQ', if_true: files('sandpiper.c'))" >> src/hw/display/meson.build
+grep -q '"sandpiper"' src/hw/arm/xilinx_zynq.c || sed -i '/arm_load_kernel(/i \    sysbus_create_simple("sandpiper", 0x40000000, NULL);' src/hw/arm/xilinx_zynq.c
+cd src && ./configure --target-list=arm-softmmu && make -j$(nproc)
@@ -0,0 +1,7 @@
+# DISPLAY_ARGS and AUDIO_ARGS can be overridden, e.g. DISPLAY_ARGS="-display none" AUDIO_ARGS="-audiodev none,id=snd0" for headless runs
+# The machine creates the sandpiper device itself, so its audio backend is picked through a global property and has to be called snd0
+DISPLAY_ARGS=${DISPLAY_ARGS:-"-display gtk"}
+AUDIO_ARGS=${AUDIO_ARGS:-"-audiodev pa,id=snd0"}
+src/build/qemu-system-arm -M xilinx-zynq-a9 -m 1024 -serial null -serial mon:stdio $DISPLAY_ARGS $AUDIO_ARGS -global sandpiper.audiodev=snd0 \
+	-kernel ../images/linux/zImage -dtb ../images/linux/system.dtb -initrd ../images/linux/rootfs.cpio.gz \
+	-append "console=ttyPS0,115200 root=/dev/ram0 rw"
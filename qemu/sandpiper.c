@@ -0,0 +1,566 @@
+/*
+ * Sandpiper register blocks
+ *
+ * Models the four 4K register pages the sandpiper fabric exposes at 0x40000000:
+ * APU, VPU, palette and VCP. Command FIFO words are decoded as they are written,
+ * the VPU scans out guest memory to a QEMU console and the APU plays its buffers
+ * through the QEMU audio backend.
+ *
+ * The fabric has no interrupt lines to the PS, so neither does this model.
+ * The driver finds vblank and audio buffer completion by polling word 0 of the
+ * VPU and APU pages, which count up each time one happens.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "hw/sysbus.h"
+#include "hw/qdev-properties.h"
+#include "exec/address-spaces.h"
+#include "ui/console.h"
+#include "audio/audio.h"
+#include "qom/object.h"
+
+#define TYPE_SANDPIPER "sandpiper"
+OBJECT_DECLARE_SIMPLE_TYPE(SandpiperState, SANDPIPER)
+
+/* One page per unit, in the order the driver maps them */
+#define SP_PAGE_SIZE            0x1000
+#define SP_AUDIO_PAGE           0
+#define SP_VIDEO_PAGE           1
+#define SP_PALETTE_PAGE         2
+#define SP_VCP_PAGE             3
+#define SP_PAGE_COUNT           4
+
+/* Register words read back by the driver */
+#define SP_STATUS_OFFSET        0
+#define SP_FIFO_LEVEL_OFFSET    1
+
+/* Command opcodes live in the low bits of a command word */
+#define SP_OPCODE_MASK          0xF
+
+/* VPU command fifo commands */
+#define VPUCMD_SETVPAGE         0x0
+#define VPUCMD_SETVMODE         0x2
+#define VPUCMD_SHIFTCACHE       0x3
+#define VPUCMD_SHIFTSCANOUT     0x4
+#define VPUCMD_SHIFTPIXEL       0x5
+#define VPUCMD_SETVPAGE2        0x6
+#define VPUCMD_SYNCSWAP         0x7
+#define VPUCMD_WCONTROLREG      0x8
+#define VPUCMD_WPROGADDR        0x9
+#define VPUCMD_WPROGWORD        0xA
+
+/* Video mode control word, see MAKEVMODEINFO */
+#define VMODE_SCAN_ENABLE       (1 << 0)
+#define VMODE_640_WIDE          (1 << 1)
+#define VMODE_16BIT_RGB         (1 << 2)
+
+/* APU command fifo commands */
+#define APUCMD_BUFFERSIZE       0x0
+#define APUCMD_START            0x1
+#define APUCMD_NOOP             0x2
+#define APUCMD_SWAPCHANNELS     0x3
+#define APUCMD_SETRATE          0x4
+
+enum {
+    ASR_44_100_Hz,
+    ASR_22_050_Hz,
+    ASR_11_025_Hz,
+    ASR_Halt,
+};
+
+/* VCP command fifo commands */
+#define VCPSETBUFFERSIZE        0x0
+#define VCPSTARTDMA             0x1
+#define VCPEXEC                 0x2
+
+#define SP_PALETTE_ENTRIES      256
+#define SP_DISPLAY_WIDTH        640
+#define SP_DISPLAY_HEIGHT       480
+#define SP_VBLANK_HZ            60
+/* Buffers the APU accepts ahead of the one playing */
+#define SP_APU_QUEUE            4
+
+/* Decoder state of one command FIFO, commands with an argument wait for the next word */
+typedef struct SandpiperFifo {
+    uint32_t command;
+    bool need_arg;
+} SandpiperFifo;
+
+struct SandpiperState {
+    SysBusDevice parent_obj;
+
+    MemoryRegion iomem;
+    QemuConsole *con;
+    QEMUTimer *vblank_timer;
+    QEMUSoundCard card;
+    SWVoiceOut *voice;
+
+    SandpiperFifo fifo[SP_PAGE_COUNT];
+
+    /* VPU */
+    uint32_t vblank_count;
+    uint32_t vmode;
+    uint32_t scanout_page;
+    uint32_t pending_page;
+    bool page_pending;
+    uint32_t palette[SP_PALETTE_ENTRIES];
+
+    /* APU */
+    uint32_t audio_count;
+    uint32_t audio_words;
+    uint32_t audio_rate;
+    bool audio_swap;
+    uint32_t audio_queue[SP_APU_QUEUE];
+    uint32_t audio_head;
+    uint32_t audio_queued;
+    uint32_t audio_size;        /* Bytes in the buffer playing, zero when idle */
+    uint32_t audio_pos;
+
+    /* VCP, programs are fetched but not executed */
+    uint32_t vcp_words;
+    uint32_t vcp_addr;
+};
+
+static bool sandpiper_has_arg(unsigned page, uint32_t opcode)
+{
+    switch (page) {
+    case SP_VIDEO_PAGE:
+        return opcode != VPUCMD_SYNCSWAP && opcode != VPUCMD_WCONTROLREG &&
+               opcode <= VPUCMD_WPROGWORD;
+    case SP_AUDIO_PAGE:
+        return opcode != APUCMD_NOOP && opcode <= APUCMD_SETRATE;
+    case SP_VCP_PAGE:
+        return opcode == VCPSETBUFFERSIZE || opcode == VCPSTARTDMA;
+    default:
+        return false;
+    }
+}
+
+static uint32_t sandpiper_rate_hz(uint32_t rate)
+{
+    switch (rate) {
+    case ASR_22_050_Hz:
+        return 22050;
+    case ASR_11_025_Hz:
+        return 11025;
+    default:
+        return 44100;
+    }
+}
+
+/* Video */
+
+static void sandpiper_vblank(void *opaque)
+{
+    SandpiperState *s = opaque;
+
+    /* SETVPAGE takes effect while the beam is outside the visible area */
+    if (s->page_pending) {
+        s->scanout_page = s->pending_page;
+        s->page_pending = false;
+    }
+    s->vblank_count++;
+
+    timer_mod(s->vblank_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              NANOSECONDS_PER_SECOND / SP_VBLANK_HZ);
+}
+
+static void sandpiper_video_command(SandpiperState *s, uint32_t command, uint32_t arg)
+{
+    switch (command & SP_OPCODE_MASK) {
+    case VPUCMD_SETVPAGE:
+        s->pending_page = arg;
+        s->page_pending = true;
+        break;
+    case VPUCMD_SETVMODE:
+        s->vmode = arg;
+        break;
+    case VPUCMD_SHIFTCACHE:
+    case VPUCMD_SHIFTSCANOUT:
+    case VPUCMD_SHIFTPIXEL:
+    case VPUCMD_SETVPAGE2:
+    case VPUCMD_SYNCSWAP:
+    case VPUCMD_WCONTROLREG:
+    case VPUCMD_WPROGADDR:
+    case VPUCMD_WPROGWORD:
+        qemu_log_mask(LOG_UNIMP, "%s: VPU command 0x%x not modelled\n",
+                      __func__, command);
+        break;
+    default:
+        break;
+    }
+}
+
+static inline uint32_t sandpiper_rgb565(uint16_t pixel)
+{
+    uint32_t r = (pixel >> 11) & 0x1f;
+    uint32_t g = (pixel >> 5) & 0x3f;
+    uint32_t b = pixel & 0x1f;
+
+    return ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+/*
+ * The output is always 640x480, 320 wide modes double every pixel and line.
+ * Guest memory is read back every refresh since any client may draw into the
+ * scanout page through its own mapping.
+ */
+static void sandpiper_update(void *opaque)
+{
+    SandpiperState *s = opaque;
+    DisplaySurface *surface = qemu_console_surface(s->con);
+    bool wide = s->vmode & VMODE_640_WIDE;
+    bool rgb = s->vmode & VMODE_16BIT_RGB;
+    unsigned src_width = wide ? SP_DISPLAY_WIDTH : SP_DISPLAY_WIDTH / 2;
+    unsigned src_stride = src_width * (rgb ? 2 : 1);
+    uint8_t line[SP_DISPLAY_WIDTH * 2];
+    unsigned x, y;
+
+    if (!surface || surface_width(surface) != SP_DISPLAY_WIDTH ||
+        surface_height(surface) != SP_DISPLAY_HEIGHT) {
+        qemu_console_resize(s->con, SP_DISPLAY_WIDTH, SP_DISPLAY_HEIGHT);
+        surface = qemu_console_surface(s->con);
+    }
+
+    for (y = 0; y < SP_DISPLAY_HEIGHT; y++) {
+        uint32_t *dst = (uint32_t *)(surface_data(surface) + y * surface_stride(surface));
+        unsigned src_y = wide ? y : y / 2;
+
+        if (!(s->vmode & VMODE_SCAN_ENABLE)) {
+            memset(dst, 0, SP_DISPLAY_WIDTH * sizeof(uint32_t));
+            continue;
+        }
+
+        address_space_read(&address_space_memory, s->scanout_page + src_y * src_stride,
+                           MEMTXATTRS_UNSPECIFIED, line, src_stride);
+
+        for (x = 0; x < SP_DISPLAY_WIDTH; x++) {
+            unsigned src_x = wide ? x : x / 2;
+
+            if (rgb) {
+                dst[x] = sandpiper_rgb565(lduw_le_p(line + src_x * 2));
+            } else {
+                dst[x] = s->palette[line[src_x]] & 0x00ffffff;
+            }
+        }
+    }
+
+    dpy_gfx_update_full(s->con);
+}
+
+static const GraphicHwOps sandpiper_gfx_ops = {
+    .gfx_update = sandpiper_update,
+};
+
+/* Audio */
+
+static void sandpiper_audio_next(SandpiperState *s)
+{
+    s->audio_pos = 0;
+    s->audio_size = 0;
+    if (s->audio_queued) {
+        s->audio_size = s->audio_words * sizeof(uint32_t);
+        s->audio_queued--;
+    }
+}
+
+/* Pulls from the buffer playing, finishing it bumps the counter the driver polls */
+static void sandpiper_audio_callback(void *opaque, int avail)
+{
+    SandpiperState *s = opaque;
+    uint8_t samples[4096];
+
+    while (avail > 0 && s->audio_size) {
+        uint32_t addr = s->audio_queue[s->audio_head];
+        size_t chunk = MIN(MIN((size_t)avail, sizeof(samples)), s->audio_size - s->audio_pos);
+        size_t written;
+
+        /* Whole stereo frames only */
+        chunk &= ~(size_t)3;
+        if (!chunk) {
+            break;
+        }
+
+        address_space_read(&address_space_memory, addr + s->audio_pos,
+                           MEMTXATTRS_UNSPECIFIED, samples, chunk);
+        if (s->audio_swap) {
+            size_t i;
+
+            for (i = 0; i < chunk; i += 4) {
+                uint32_t frame = ldl_le_p(samples + i);
+                stl_le_p(samples + i, (frame << 16) | (frame >> 16));
+            }
+        }
+
+        written = AUD_write(s->voice, samples, chunk);
+        if (!written) {
+            break;
+        }
+        s->audio_pos += written;
+        avail -= written;
+
+        if (s->audio_pos >= s->audio_size) {
+            s->audio_head = (s->audio_head + 1) % SP_APU_QUEUE;
+            s->audio_count++;
+            sandpiper_audio_next(s);
+        }
+    }
+}
+
+static void sandpiper_audio_open(SandpiperState *s)
+{
+    struct audsettings as = {
+        .freq = sandpiper_rate_hz(s->audio_rate),
+        .nchannels = 2,
+        .fmt = AUDIO_FORMAT_S16,
+        .endianness = 0,
+    };
+
+    s->voice = AUD_open_out(&s->card, s->voice, "sandpiper", s,
+                            sandpiper_audio_callback, &as);
+}
+
+static void sandpiper_audio_command(SandpiperState *s, uint32_t command, uint32_t arg)
+{
+    switch (command & SP_OPCODE_MASK) {
+    case APUCMD_BUFFERSIZE:
+        s->audio_words = arg;
+        break;
+    case APUCMD_START:
+        if (s->audio_queued + (s->audio_size ? 1 : 0) >= SP_APU_QUEUE) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: APU buffer queue full\n", __func__);
+            break;
+        }
+        s->audio_queue[(s->audio_head + s->audio_queued + (s->audio_size ? 1 : 0)) % SP_APU_QUEUE] = arg;
+        s->audio_queued++;
+        if (!s->audio_size) {
+            sandpiper_audio_next(s);
+        }
+        if (s->voice && s->audio_rate != ASR_Halt) {
+            AUD_set_active_out(s->voice, true);
+        }
+        break;
+    case APUCMD_SWAPCHANNELS:
+        s->audio_swap = arg != 0;
+        break;
+    case APUCMD_SETRATE:
+        s->audio_rate = arg & 3;
+        if (s->audio_rate == ASR_Halt) {
+            /* Halting drops whatever was queued */
+            s->audio_queued = 0;
+            s->audio_size = 0;
+            s->audio_pos = 0;
+            if (s->voice) {
+                AUD_set_active_out(s->voice, false);
+            }
+        } else {
+            sandpiper_audio_open(s);
+            if (s->voice && s->audio_size) {
+                AUD_set_active_out(s->voice, true);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* VCP */
+
+static void sandpiper_vcp_command(SandpiperState *s, uint32_t command, uint32_t arg)
+{
+    switch (command & SP_OPCODE_MASK) {
+    case VCPSETBUFFERSIZE:
+        s->vcp_words = arg;
+        break;
+    case VCPSTARTDMA:
+        s->vcp_addr = arg;
+        break;
+    case VCPEXEC:
+        if (s->vcp_words) {
+            qemu_log_mask(LOG_UNIMP, "%s: VCP program at 0x%x (%u words) not executed\n",
+                          __func__, s->vcp_addr, s->vcp_words);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Register access */
+
+static void sandpiper_fifo_write(SandpiperState *s, unsigned page, uint32_t word)
+{
+    SandpiperFifo *fifo = &s->fifo[page];
+    uint32_t command = word;
+    uint32_t arg = 0;
+
+    if (fifo->need_arg) {
+        command = fifo->command;
+        arg = word;
+        fifo->need_arg = false;
+    } else if (sandpiper_has_arg(page, word & SP_OPCODE_MASK)) {
+        fifo->command = word;
+        fifo->need_arg = true;
+        return;
+    }
+
+    switch (page) {
+    case SP_AUDIO_PAGE:
+        sandpiper_audio_command(s, command, arg);
+        break;
+    case SP_VIDEO_PAGE:
+        sandpiper_video_command(s, command, arg);
+        break;
+    case SP_VCP_PAGE:
+        sandpiper_vcp_command(s, command, arg);
+        break;
+    }
+}
+
+static uint64_t sandpiper_read(void *opaque, hwaddr addr, unsigned size)
+{
+    SandpiperState *s = opaque;
+    unsigned page = addr / SP_PAGE_SIZE;
+    unsigned word = (addr % SP_PAGE_SIZE) / sizeof(uint32_t);
+
+    if (page == SP_PALETTE_PAGE) {
+        return word < SP_PALETTE_ENTRIES ? s->palette[word] : 0;
+    }
+
+    switch (word) {
+    case SP_STATUS_OFFSET:
+        if (page == SP_VIDEO_PAGE) {
+            return s->vblank_count;
+        }
+        if (page == SP_AUDIO_PAGE) {
+            return s->audio_count;
+        }
+        /* The VCP never has a program running */
+        return 0;
+    case SP_FIFO_LEVEL_OFFSET:
+        /* Commands are consumed as they are written */
+        return 0;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: bad offset 0x%" HWADDR_PRIx "\n",
+                      __func__, addr);
+        return 0;
+    }
+}
+
+static void sandpiper_write(void *opaque, hwaddr addr, uint64_t value, unsigned size)
+{
+    SandpiperState *s = opaque;
+    unsigned page = addr / SP_PAGE_SIZE;
+    unsigned word = (addr % SP_PAGE_SIZE) / sizeof(uint32_t);
+
+    if (page == SP_PALETTE_PAGE) {
+        if (word < SP_PALETTE_ENTRIES) {
+            s->palette[word] = value;
+        }
+        return;
+    }
+
+    /* Every word written anywhere in a unit's page goes to its command FIFO */
+    sandpiper_fifo_write(s, page, value);
+}
+
+static const MemoryRegionOps sandpiper_ops = {
+    .read = sandpiper_read,
+    .write = sandpiper_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+};
+
+static void sandpiper_reset_hold(Object *obj, ResetType type)
+{
+    SandpiperState *s = SANDPIPER(obj);
+
+    memset(s->fifo, 0, sizeof(s->fifo));
+    memset(s->palette, 0, sizeof(s->palette));
+    s->vblank_count = 0;
+    s->vmode = 0;
+    s->scanout_page = 0;
+    s->page_pending = false;
+
+    s->audio_count = 0;
+    s->audio_words = 0;
+    s->audio_rate = ASR_Halt;
+    s->audio_swap = false;
+    s->audio_head = 0;
+    s->audio_queued = 0;
+    s->audio_size = 0;
+    s->audio_pos = 0;
+    if (s->voice) {
+        AUD_set_active_out(s->voice, false);
+    }
+
+    s->vcp_words = 0;
+    s->vcp_addr = 0;
+}
+
+static void sandpiper_realize(DeviceState *dev, Error **errp)
+{
+    SandpiperState *s = SANDPIPER(dev);
+
+    if (!AUD_register_card("sandpiper", &s->card, errp)) {
+        return;
+    }
+    sandpiper_audio_open(s);
+
+    s->con = graphic_console_init(dev, 0, &sandpiper_gfx_ops, s);
+    qemu_console_resize(s->con, SP_DISPLAY_WIDTH, SP_DISPLAY_HEIGHT);
+
+    s->vblank_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, sandpiper_vblank, s);
+    timer_mod(s->vblank_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              NANOSECONDS_PER_SECOND / SP_VBLANK_HZ);
+}
+
+static void sandpiper_init(Object *obj)
+{
+    SandpiperState *s = SANDPIPER(obj);
+
+    memory_region_init_io(&s->iomem, obj, &sandpiper_ops, s, TYPE_SANDPIPER,
+                          SP_PAGE_COUNT * SP_PAGE_SIZE);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->iomem);
+}
+
+static Property sandpiper_properties[] = {
+    DEFINE_AUDIO_PROPERTIES(SandpiperState, card),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void sandpiper_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    ResettableClass *rc = RESETTABLE_CLASS(klass);
+
+    dc->realize = sandpiper_realize;
+    rc->phases.hold = sandpiper_reset_hold;
+    set_bit(DEVICE_CATEGORY_DISPLAY, dc->categories);
+    device_class_set_props(dc, sandpiper_properties);
+}
+
+static const TypeInfo sandpiper_info = {
+    .name          = TYPE_SANDPIPER,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(SandpiperState),
+    .instance_init = sandpiper_init,
+    .class_init    = sandpiper_class_init,
+};
+
+static void sandpiper_register_types(void)
+{
+    type_register_static(&sandpiper_info);
+}
+
+type_init(sandpiper_register_types)
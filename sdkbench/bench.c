@@ -0,0 +1,348 @@
+// Device I/O micro-benchmarks for the sandpiper driver
+// Every result is printed to stdout as one JSON object per line, a readable summary goes to stderr.
+// Runs the same on the board, under QEMU with the sandpiper device model, and against the host simulator.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "sandpiper_abi.h"
+
+#define REGION_BYTES		(1024*1024)
+#define FRAME_BYTES_640		(640*480*2)
+#define FRAME_BYTES_320		(320*240)
+#define RANDOM_WRITES		(64*1024)
+
+static const char *s_mapModeNames[] = { "uncached", "writecombine", "cached" };
+static int s_scale = 1;
+
+static uint64_t NowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// One JSON line per result, the unit says how to read value
+static void Report(const char *name, const char *mode, const char *unit, double value, double best, uint32_t iterations)
+{
+	printf("{\"name\":\"%s\",\"mode\":\"%s\",\"unit\":\"%s\",\"value\":%.3f,\"best\":%.3f,\"iterations\":%u}\n", name, mode, unit, value, best, iterations);
+	fflush(stdout);
+	fprintf(stderr, "%-24s %-13s %12.3f %-6s (best %.3f)\n", name, mode, value, unit, best);
+}
+
+// Average and best time per operation over a number of runs of count operations each
+struct Timing
+{
+	uint64_t total;
+	uint64_t best;
+	uint32_t runs;
+};
+
+static void AddRun(struct Timing *timing, uint64_t elapsed)
+{
+	if (timing->runs == 0 || elapsed < timing->best)
+		timing->best = elapsed;
+	timing->total += elapsed;
+	timing->runs++;
+}
+
+static void ReportLatency(const char *name, const char *mode, struct Timing *timing, uint32_t count)
+{
+	Report(name, mode, "ns/op", (double)timing->total / timing->runs / count, (double)timing->best / count, timing->runs * count);
+}
+
+static void ReportBandwidth(const char *name, const char *mode, struct Timing *timing, uint32_t bytes)
+{
+	// Bytes per nanosecond times 1000 is Mbytes per second
+	Report(name, mode, "MB/s", (double)bytes * timing->runs * 1000.0 / timing->total, (double)bytes * 1000.0 / timing->best, timing->runs);
+}
+
+static int SetMapMode(int spfd, uint32_t mode)
+{
+	struct SPIoctl data;
+	data.offset = 0;
+	data.value = mode;
+	return ioctl(spfd, SP_IOCTL_SET_MAP_MODE, &data);
+}
+
+static int Submit(int spfd, uint32_t *words, uint32_t count)
+{
+	struct SPSubmit submit;
+	submit.count = count;
+	submit.words = (uint32_t)(uintptr_t)words;
+	return ioctl(spfd, SP_IOCTL_VPU_SUBMIT, &submit);
+}
+
+static void *MapAllocation(int spfd, uint32_t address, uint32_t size, uint32_t mode)
+{
+	void *cpu;
+	if (SetMapMode(spfd, mode) < 0)
+		return NULL;
+	cpu = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spfd, address);
+	return cpu == MAP_FAILED ? NULL : cpu;
+}
+
+// Register round trips
+
+static void BenchIoctls(int spfd)
+{
+	const uint32_t count = 1000;
+	struct Timing read = {0}, write = {0}, audio = {0};
+	struct SPIoctl data;
+
+	for (int run = 0; run < 10 * s_scale; ++run)
+	{
+		uint64_t start = NowNs();
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			data.offset = 0;
+			ioctl(spfd, SP_IOCTL_VIDEO_READ, &data);
+		}
+		AddRun(&read, NowNs() - start);
+
+		// NOOPs go through the command FIFOs without changing any state
+		start = NowNs();
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			data.offset = 0;
+			data.value = VPUCMD_NOOP;
+			ioctl(spfd, SP_IOCTL_VIDEO_WRITE, &data);
+		}
+		AddRun(&write, NowNs() - start);
+
+		start = NowNs();
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			data.offset = 0;
+			data.value = APUCMD_NOOP;
+			ioctl(spfd, SP_IOCTL_AUDIO_WRITE, &data);
+		}
+		AddRun(&audio, NowNs() - start);
+	}
+
+	ReportLatency("ioctl_video_read", "-", &read, count);
+	ReportLatency("ioctl_video_write", "-", &write, count);
+	ReportLatency("ioctl_audio_write", "-", &audio, count);
+}
+
+// Memory bandwidth
+
+static void CopyNeon(uint8_t *dst, const uint8_t *src, uint32_t bytes)
+{
+#if defined(__ARM_NEON)
+	for (uint32_t i = 0; i < bytes; i += 64)
+	{
+		uint8x16_t a = vld1q_u8(src + i);
+		uint8x16_t b = vld1q_u8(src + i + 16);
+		uint8x16_t c = vld1q_u8(src + i + 32);
+		uint8x16_t d = vld1q_u8(src + i + 48);
+		vst1q_u8(dst + i, a);
+		vst1q_u8(dst + i + 16, b);
+		vst1q_u8(dst + i + 32, c);
+		vst1q_u8(dst + i + 48, d);
+	}
+#else
+	memcpy(dst, src, bytes);
+#endif
+}
+
+static void BenchBandwidth(int spfd, uint32_t address, uint32_t mode, const uint8_t *source, const uint32_t *randomOffsets)
+{
+	const char *modeName = s_mapModeNames[mode];
+	struct Timing seq = {0}, rnd = {0}, set = {0}, copy = {0}, neon = {0};
+	volatile uint32_t *words;
+	uint8_t *cpu = MapAllocation(spfd, address, REGION_BYTES, mode);
+
+	if (!cpu)
+	{
+		perror("mmap region");
+		return;
+	}
+	words = (volatile uint32_t*)cpu;
+
+	for (int run = 0; run < 5 * s_scale; ++run)
+	{
+		uint64_t start = NowNs();
+		for (uint32_t i = 0; i < REGION_BYTES / sizeof(uint32_t); ++i)
+			words[i] = i;
+		AddRun(&seq, NowNs() - start);
+
+		start = NowNs();
+		for (uint32_t i = 0; i < RANDOM_WRITES; ++i)
+			words[randomOffsets[i]] = i;
+		AddRun(&rnd, NowNs() - start);
+
+		start = NowNs();
+		memset(cpu, run, REGION_BYTES);
+		AddRun(&set, NowNs() - start);
+
+		start = NowNs();
+		memcpy(cpu, source, REGION_BYTES);
+		AddRun(&copy, NowNs() - start);
+
+		start = NowNs();
+		CopyNeon(cpu, source, REGION_BYTES);
+		AddRun(&neon, NowNs() - start);
+	}
+
+	ReportBandwidth("seq_write", modeName, &seq, REGION_BYTES);
+	ReportBandwidth("random_write", modeName, &rnd, RANDOM_WRITES * sizeof(uint32_t));
+	ReportBandwidth("memset", modeName, &set, REGION_BYTES);
+	ReportBandwidth("memcpy", modeName, &copy, REGION_BYTES);
+#if defined(__ARM_NEON)
+	ReportBandwidth("neon_copy", modeName, &neon, REGION_BYTES);
+#endif
+
+	munmap(cpu, REGION_BYTES);
+}
+
+// Palette
+
+static void BenchPalette(int spfd)
+{
+	static uint32_t entries[PALETTE_ENTRIES];
+	struct Timing single = {0}, load = {0};
+	struct SPIoctl data;
+	struct SPPalette palette;
+
+	for (uint32_t i = 0; i < PALETTE_ENTRIES; ++i)
+		entries[i] = (i << 16) | (i << 8) | i;
+
+	palette.first = 0;
+	palette.count = PALETTE_ENTRIES;
+	palette.entries = (uint32_t)(uintptr_t)entries;
+	palette.latch = EPL_Immediate;
+
+	for (int run = 0; run < 100 * s_scale; ++run)
+	{
+		uint64_t start = NowNs();
+		for (uint32_t i = 0; i < PALETTE_ENTRIES; ++i)
+		{
+			data.offset = i;
+			data.value = entries[i];
+			ioctl(spfd, SP_IOCTL_PALETTE_WRITE, &data);
+		}
+		AddRun(&single, NowNs() - start);
+
+		start = NowNs();
+		ioctl(spfd, SP_IOCTL_PALETTE_LOAD, &palette);
+		AddRun(&load, NowNs() - start);
+	}
+
+	ReportLatency("palette_write_256", "-", &single, 1);
+	ReportLatency("palette_load_256", "-", &load, 1);
+}
+
+// Full frame present: copy a frame into a scanout page and queue SETVPAGE, without waiting for vblank
+
+static void BenchPresent(int spfd, uint32_t address, uint32_t mode, const uint8_t *source, int wide)
+{
+	uint32_t bytes = wide ? FRAME_BYTES_640 : FRAME_BYTES_320;
+	uint32_t vmode = wide ? MAKEVMODEINFO(ECM_16bit_RGB, EVM_640_Wide, EVS_Enable) : MAKEVMODEINFO(ECM_8bit_Indexed, EVM_320_Wide, EVS_Enable);
+	uint32_t words[4] = { VPUCMD_SETVMODE, vmode, VPUCMD_SETVPAGE, 0 };
+	struct Timing present = {0};
+	uint8_t *cpu = MapAllocation(spfd, address, 2 * FRAME_BYTES_640, mode);
+
+	if (!cpu)
+	{
+		perror("mmap frames");
+		return;
+	}
+
+	Submit(spfd, words, 2);
+	for (int run = 0; run < 60 * s_scale; ++run)
+	{
+		uint32_t page = run & 1;
+		uint64_t start = NowNs();
+		memcpy(cpu + page * FRAME_BYTES_640, source, bytes);
+		words[3] = address + page * FRAME_BYTES_640;
+		Submit(spfd, &words[2], 2);
+		AddRun(&present, NowNs() - start);
+	}
+
+	ReportLatency(wide ? "present_640" : "present_320", s_mapModeNames[mode], &present, 1);
+	munmap(cpu, 2 * FRAME_BYTES_640);
+}
+
+static int Alloc(int spfd, uint32_t size, uint32_t *address)
+{
+	struct SPAlloc alloc;
+	alloc.size = size;
+	alloc.address = 0;
+	if (ioctl(spfd, SP_IOCTL_ALLOC, &alloc) < 0)
+		return -1;
+	*address = alloc.address;
+	return 0;
+}
+
+int main(int argc, char**argv)
+{
+	uint32_t region, frames;
+	uint8_t *source;
+	uint32_t *randomOffsets;
+	uint32_t seed = 0x12345678;
+
+	// An optional argument multiplies the number of runs of every benchmark
+	if (argc > 1)
+		s_scale = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+
+	int spfd = open("/dev/sandpiper", O_RDWR);
+	if (spfd < 0)
+	{
+		perror("/dev/sandpiper");
+		return 1;
+	}
+
+	if (Alloc(spfd, REGION_BYTES, &region) < 0 || Alloc(spfd, 2 * FRAME_BYTES_640, &frames) < 0)
+	{
+		perror("SP_IOCTL_ALLOC");
+		return 1;
+	}
+
+	// Cached source data and a fixed random store pattern, so runs are comparable
+	source = aligned_alloc(64, REGION_BYTES);
+	randomOffsets = malloc(RANDOM_WRITES * sizeof(uint32_t));
+	if (!source || !randomOffsets)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (uint32_t i = 0; i < REGION_BYTES; ++i)
+		source[i] = (uint8_t)(i * 7);
+	for (uint32_t i = 0; i < RANDOM_WRITES; ++i)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		randomOffsets[i] = seed % (REGION_BYTES / sizeof(uint32_t));
+	}
+
+	BenchIoctls(spfd);
+	for (uint32_t mode = EMM_Uncached; mode <= EMM_Cached; ++mode)
+		BenchBandwidth(spfd, region, mode, source, randomOffsets);
+	BenchPalette(spfd);
+	for (uint32_t mode = EMM_Uncached; mode <= EMM_WriteCombine; ++mode)
+	{
+		BenchPresent(spfd, frames, mode, source, 0);
+		BenchPresent(spfd, frames, mode, source, 1);
+	}
+
+	free(randomOffsets);
+	free(source);
+
+	// Closing the device hands the display back to the console and returns the pool memory
+	close(spfd);
+
+	return 0;
+}
@@ -0,0 +1 @@
+arm-amd-linux-gnueabi-gcc --sysroot=/opt/petalinux/2025.1/sysroots/cortexa9t2hf-neon-amd-linux-gnueabi/ -mcpu=cortex-a9 -mfpu=neon -mfloat-abi=hard -O2 -I../sdkcommon bench.c -o bench
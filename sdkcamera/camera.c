@@ -0,0 +1,377 @@
+// Live camera preview straight from a V4L2 capture device to the sandpiper scanout
+// Capture buffers are allocated from the sandpiper memory pool and handed to V4L2 as dma-bufs,
+// so an RGB565 camera frame is scanned out from the very memory the camera driver filled.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+
+#include "sandpiper_abi.h"
+
+#define WIDTH			640
+#define HEIGHT			480
+#define FRAME_BYTES		(WIDTH*HEIGHT*2)
+#define CAPTURE_COUNT	4
+#define REPORT_FRAMES	120
+
+struct CaptureBuffer
+{
+	uint32_t address;	// Physical address, used as the scanout page
+	int dmabuf;			// Exported dma-buf handed to V4L2
+	uint8_t *cpu;		// Cached mapping, only used when the camera can't deliver RGB565
+};
+
+struct LatencyStats
+{
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void OnSignal(int sig)
+{
+	s_quit = 1;
+}
+
+static uint64_t TimevalToNs(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000000ull + (uint64_t)tv->tv_usec * 1000ull;
+}
+
+static void AddSample(struct LatencyStats *stats, uint64_t value)
+{
+	if (stats->count == 0 || value < stats->min)
+		stats->min = value;
+	if (value > stats->max)
+		stats->max = value;
+	stats->total += value;
+	stats->count++;
+}
+
+static void PrintStats(const char *name, struct LatencyStats *stats)
+{
+	if (stats->count == 0)
+		return;
+	printf("%-18s min %6.2f ms  avg %6.2f ms  max %6.2f ms\n", name, stats->min / 1e6, (stats->total / stats->count) / 1e6, stats->max / 1e6);
+	memset(stats, 0, sizeof(*stats));
+}
+
+static int SubmitWords(int spfd, uint32_t *words, uint32_t count)
+{
+	struct SPSubmit submit;
+	submit.count = count;
+	submit.words = (uint32_t)(uintptr_t)words;
+	return ioctl(spfd, SP_IOCTL_VPU_SUBMIT, &submit);
+}
+
+static int ShowPage(int spfd, uint32_t address)
+{
+	uint32_t words[2] = { VPUCMD_SETVPAGE, address };
+	return SubmitWords(spfd, words, 2);
+}
+
+// Fallback for cameras without RGB565 output, costs one conversion pass instead of a copy plus conversion
+static void ConvertYUYV(const uint8_t *src, uint16_t *dst)
+{
+	for (int i = 0; i < WIDTH * HEIGHT; i += 2, src += 4)
+	{
+		int y0 = src[0] - 16, u = src[1] - 128, y1 = src[2] - 16, v = src[3] - 128;
+		int ys[2] = { y0, y1 };
+		for (int j = 0; j < 2; ++j)
+		{
+			int c = 298 * ys[j];
+			int r = (c + 409 * v + 128) >> 8;
+			int g = (c - 100 * u - 208 * v + 128) >> 8;
+			int b = (c + 516 * u + 128) >> 8;
+			r = r < 0 ? 0 : (r > 255 ? 255 : r);
+			g = g < 0 ? 0 : (g > 255 ? 255 : g);
+			b = b < 0 ? 0 : (b > 255 ? 255 : b);
+			dst[i + j] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+		}
+	}
+}
+
+static int AllocBuffer(int spfd, uint32_t *address)
+{
+	struct SPAlloc alloc;
+	alloc.size = FRAME_BYTES;
+	alloc.address = 0;
+	if (ioctl(spfd, SP_IOCTL_ALLOC, &alloc) < 0)
+		return -1;
+	*address = alloc.address;
+	return 0;
+}
+
+static int QueueCapture(int vfd, struct CaptureBuffer *buffers, int index)
+{
+	struct v4l2_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.index = index;
+	buf.m.fd = buffers[index].dmabuf;
+	buf.length = FRAME_BYTES;
+	return ioctl(vfd, VIDIOC_QBUF, &buf);
+}
+
+int main(int argc, char**argv)
+{
+	const char *videodev = argc > 1 ? argv[1] : "/dev/video0";
+	struct CaptureBuffer buffers[CAPTURE_COUNT];
+	uint32_t convert[2] = { 0, 0 };
+	uint16_t *convertcpu[2] = { NULL, NULL };
+	int convertnext = 0;
+	int direct = 1;
+
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+
+	int spfd = open("/dev/sandpiper", O_RDWR);
+	if (spfd < 0)
+	{
+		perror("/dev/sandpiper");
+		return 1;
+	}
+
+	int vfd = open(videodev, O_RDWR | O_NONBLOCK);
+	if (vfd < 0)
+	{
+		perror(videodev);
+		return 1;
+	}
+
+	// Prefer RGB565 so the captured frame can be scanned out as is
+	struct v4l2_format fmt;
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = WIDTH;
+	fmt.fmt.pix.height = HEIGHT;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB565;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (ioctl(vfd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_RGB565)
+	{
+		fmt.fmt.pix.width = WIDTH;
+		fmt.fmt.pix.height = HEIGHT;
+		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+		if (ioctl(vfd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV)
+		{
+			fprintf(stderr, "camera supports neither RGB565 nor YUYV\n");
+			return 1;
+		}
+		direct = 0;
+	}
+	if (fmt.fmt.pix.width != WIDTH || fmt.fmt.pix.height != HEIGHT || fmt.fmt.pix.bytesperline != WIDTH * 2)
+	{
+		fprintf(stderr, "camera can't capture %dx%d\n", WIDTH, HEIGHT);
+		return 1;
+	}
+	printf("capturing %s from %s\n", direct ? "RGB565 (zero-copy)" : "YUYV (converted)", videodev);
+
+	// Capture buffers live in the sandpiper pool and are shared with V4L2 as dma-bufs
+	for (int i = 0; i < CAPTURE_COUNT; ++i)
+	{
+		struct SPExport exp;
+		if (AllocBuffer(spfd, &buffers[i].address) < 0)
+		{
+			perror("SP_IOCTL_ALLOC");
+			return 1;
+		}
+		exp.address = buffers[i].address;
+		exp.flags = O_RDWR | O_CLOEXEC;
+		if (ioctl(spfd, SP_IOCTL_EXPORT, &exp) < 0)
+		{
+			perror("SP_IOCTL_EXPORT");
+			return 1;
+		}
+		buffers[i].dmabuf = exp.fd;
+		buffers[i].cpu = NULL;
+
+		// The camera driver writes through a cached kernel mapping, which the CPU sees coherently
+		if (!direct)
+		{
+			buffers[i].cpu = (uint8_t*)mmap(NULL, FRAME_BYTES, PROT_READ, MAP_SHARED, exp.fd, 0);
+			if (buffers[i].cpu == MAP_FAILED)
+			{
+				perror("mmap dma-buf");
+				return 1;
+			}
+		}
+	}
+
+	// Converted frames go to two write-combined scanout pages
+	if (!direct)
+	{
+		struct SPIoctl mode;
+		mode.offset = 0;
+		mode.value = EMM_WriteCombine;
+		ioctl(spfd, SP_IOCTL_SET_MAP_MODE, &mode);
+		for (int i = 0; i < 2; ++i)
+		{
+			if (AllocBuffer(spfd, &convert[i]) < 0)
+			{
+				perror("SP_IOCTL_ALLOC");
+				return 1;
+			}
+			convertcpu[i] = (uint16_t*)mmap(NULL, FRAME_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, spfd, convert[i]);
+			if (convertcpu[i] == MAP_FAILED)
+			{
+				perror("mmap scanout");
+				return 1;
+			}
+		}
+	}
+
+	struct v4l2_requestbuffers req;
+	memset(&req, 0, sizeof(req));
+	req.count = CAPTURE_COUNT;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_DMABUF;
+	if (ioctl(vfd, VIDIOC_REQBUFS, &req) < 0 || req.count != CAPTURE_COUNT)
+	{
+		perror("VIDIOC_REQBUFS (DMABUF)");
+		return 1;
+	}
+
+	for (int i = 0; i < CAPTURE_COUNT; ++i)
+	{
+		if (QueueCapture(vfd, buffers, i) < 0)
+		{
+			perror("VIDIOC_QBUF");
+			return 1;
+		}
+	}
+
+	uint32_t vmode[2] = { VPUCMD_SETVMODE, MAKEVMODEINFO(ECM_16bit_RGB, EVM_640_Wide, EVS_Enable) };
+	SubmitWords(spfd, vmode, 2);
+
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (ioctl(vfd, VIDIOC_STREAMON, &type) < 0)
+	{
+		perror("VIDIOC_STREAMON");
+		return 1;
+	}
+
+	// A frame is 'pending' from SETVPAGE until the next vblank latches it, then 'shown' until replaced
+	int pending = -1, shown = -1;
+	uint64_t pendingcapture = 0, pendingdequeue = 0;
+	uint64_t frames = 0, dropped = 0;
+	struct LatencyStats capturetodequeue = {0}, dequeuetoscanout = {0}, capturetoscanout = {0};
+
+	struct pollfd fds[2];
+	fds[0].fd = vfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = spfd;
+	fds[1].events = POLLIN;
+
+	while (!s_quit)
+	{
+		if (poll(fds, 2, 1000) <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN)
+		{
+			struct v4l2_buffer buf;
+			struct timespec now;
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_DMABUF;
+			if (ioctl(vfd, VIDIOC_DQBUF, &buf) == 0)
+			{
+				uint32_t page;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+
+				// Only the newest frame is worth showing, an unlatched older one goes back to the camera
+				if (pending >= 0)
+				{
+					QueueCapture(vfd, buffers, pending);
+					dropped++;
+				}
+
+				if (direct)
+				{
+					// Push whatever the camera driver left in the CPU caches out to memory for the VPU,
+					// the buffer is only cached through its dma-buf so that is where the sync goes
+					struct dma_buf_sync sync;
+					sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+					ioctl(buffers[buf.index].dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+					page = buffers[buf.index].address;
+				}
+				else
+				{
+					ConvertYUYV(buffers[buf.index].cpu, convertcpu[convertnext]);
+					page = convert[convertnext];
+					convertnext ^= 1;
+				}
+
+				ShowPage(spfd, page);
+
+				pending = buf.index;
+				pendingcapture = TimevalToNs(&buf.timestamp);
+				pendingdequeue = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+				AddSample(&capturetodequeue, pendingdequeue - pendingcapture);
+
+				// Converted frames don't need the capture buffer once they're copied out
+				if (!direct)
+				{
+					QueueCapture(vfd, buffers, pending);
+					pending = -2;
+				}
+			}
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			struct SPEvent events[8];
+			ssize_t len = read(spfd, events, sizeof(events));
+			for (ssize_t i = 0; i < len / (ssize_t)sizeof(struct SPEvent); ++i)
+			{
+				if (events[i].type != EET_VBlank || pending == -1)
+					continue;
+
+				// The pending page is on screen now, the one it replaced can be captured into again
+				if (shown >= 0)
+					QueueCapture(vfd, buffers, shown);
+				shown = pending >= 0 ? pending : -1;
+				pending = -1;
+
+				AddSample(&dequeuetoscanout, events[i].timestamp - pendingdequeue);
+				AddSample(&capturetoscanout, events[i].timestamp - pendingcapture);
+
+				if (++frames % REPORT_FRAMES == 0)
+				{
+					printf("%llu frames, %llu dropped\n", (unsigned long long)frames, (unsigned long long)dropped);
+					PrintStats("capture->dequeue", &capturetodequeue);
+					PrintStats("dequeue->scanout", &dequeuetoscanout);
+					PrintStats("capture->scanout", &capturetoscanout);
+				}
+			}
+		}
+	}
+
+	ioctl(vfd, VIDIOC_STREAMOFF, &type);
+
+	printf("%llu frames, %llu dropped\n", (unsigned long long)frames, (unsigned long long)dropped);
+	PrintStats("capture->dequeue", &capturetodequeue);
+	PrintStats("dequeue->scanout", &dequeuetoscanout);
+	PrintStats("capture->scanout", &capturetoscanout);
+
+	// Closing the device hands the display back to the console and returns all pool memory
+	close(vfd);
+	close(spfd);
+
+	return 0;
+}
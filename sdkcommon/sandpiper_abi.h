@@ -0,0 +1,239 @@
+// User side copy of the /dev/sandpiper ABI, shared by the SDK samples, the benchmarks and the simulator
+// Keep in sync with the sandpiper driver (project-spec/meta-user/recipes-modules/sandpiper/files/sandpiper.c)
+
+#ifndef SANDPIPER_ABI_H
+#define SANDPIPER_ABI_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Reserved memory layout, mmap offsets are physical addresses
+#define PHYS_ADDR					0x18000000
+#define RESERVED_MEMORY_SIZE		0x2000000
+#define SP_PAGE_SIZE				0x1000
+#define CONSOLE_FRAMEBUFFER_ADDR	PHYS_ADDR
+#define CONSOLE_FRAMEBUFFER_SIZE	(640*480*2)
+#define DRIVER_MEMORY_SIZE			0x100000
+#define DRIVER_MEMORY_ADDR			(PHYS_ADDR + RESERVED_MEMORY_SIZE - DRIVER_MEMORY_SIZE)
+#define POOL_MEMORY_ADDR			(CONSOLE_FRAMEBUFFER_ADDR + CONSOLE_FRAMEBUFFER_SIZE)
+#define POOL_MEMORY_SIZE			(DRIVER_MEMORY_ADDR - POOL_MEMORY_ADDR)
+#define PCM_BUFFER_ADDR				DRIVER_MEMORY_ADDR
+#define PCM_BUFFER_SIZE				0x10000
+#define VCP_PROGRAM_ADDR			(PCM_BUFFER_ADDR + PCM_BUFFER_SIZE)
+#define VCP_PROGRAM_SLOT_SIZE		0x8000
+#define VCP_PROGRAM_SLOTS			2
+#define COMMAND_RING_ADDR			(VCP_PROGRAM_ADDR + VCP_PROGRAM_SLOTS * VCP_PROGRAM_SLOT_SIZE)
+#define COMMAND_RING_ENTRIES		2048
+#define COMMAND_RING_SIZE			(SP_PAGE_SIZE + COMMAND_RING_ENTRIES * sizeof(struct SPRingEntry))
+#define STATUS_PAGE_ADDR			(COMMAND_RING_ADDR + ((COMMAND_RING_SIZE + SP_PAGE_SIZE - 1) & ~(SP_PAGE_SIZE - 1)))
+
+// Register pages, 4Kbytes each
+#define AUDIO_CTRL_REGS_ADDR		0x40000000
+#define VIDEO_CTRL_REGS_ADDR		0x40001000
+#define PALETTE_CTRL_REGS_ADDR		0x40002000
+#define VCP_CTRL_REGS_ADDR			0x40003000
+#define DEVICE_MEMORY_SIZE			0x1000
+
+// Register offsets, in 32-bit words
+#define VIDEO_STATUS_OFFSET			0
+#define AUDIO_STATUS_OFFSET			0
+#define VCP_STATUS_OFFSET			0
+#define FIFO_LEVEL_OFFSET			1
+
+#define PALETTE_ENTRIES				256
+
+#define SP_IOCTL_GET_VIDEO_CTL		_IOR('k', 0, void*)
+#define SP_IOCTL_GET_AUDIO_CTL		_IOR('k', 1, void*)
+#define SP_IOCTL_GET_PALETTE_CTL	_IOR('k', 2, void*)
+#define SP_IOCTL_AUDIO_READ			_IOR('k', 3, void*)
+#define SP_IOCTL_AUDIO_WRITE		_IOW('k', 4, void*)
+#define SP_IOCTL_VIDEO_READ			_IOR('k', 5, void*)
+#define SP_IOCTL_VIDEO_WRITE		_IOW('k', 6, void*)
+#define SP_IOCTL_VCP_READ			_IOR('k', 7, void*)
+#define SP_IOCTL_VCP_WRITE			_IOW('k', 8, void*)
+#define SP_IOCTL_PALETTE_READ		_IOR('k', 9, void*)
+#define SP_IOCTL_PALETTE_WRITE		_IOW('k', 10, void*)
+#define SP_IOCTL_GET_VCP_CTL		_IOR('k', 11, void*)
+#define SP_IOCTL_VPU_SUBMIT			_IOW('k', 12, void*)
+#define SP_IOCTL_REG_PROGRAM		_IOWR('k', 13, void*)
+#define SP_IOCTL_SET_MAP_MODE		_IOW('k', 14, void*)
+#define SP_IOCTL_CACHE_SYNC			_IOW('k', 15, void*)
+#define SP_IOCTL_SET_EVENT_MASK		_IOW('k', 16, void*)
+#define SP_IOCTL_ALLOC				_IOWR('k', 17, void*)
+#define SP_IOCTL_FREE				_IOW('k', 18, void*)
+#define SP_IOCTL_EXPORT				_IOWR('k', 19, void*)
+#define SP_IOCTL_PALETTE_LOAD		_IOW('k', 20, void*)
+#define SP_IOCTL_VCP_LOAD			_IOW('k', 21, void*)
+#define SP_IOCTL_RING_DOORBELL		_IO('k', 22)
+#define SP_IOCTL_FIFO_STATUS		_IOWR('k', 23, void*)
+#define SP_URING_WAIT_EVENT			_IOW('k', 24, void*)
+
+// Video mode control word
+#define MAKEVMODEINFO(_cmode, _vmode, _scanEnable) ((_cmode&0x1)<<2) | ((_vmode&0x1)<<1) | (_scanEnable&0x1)
+#define VMODE_SCAN_ENABLE			(1 << 0)
+#define VMODE_640_WIDE				(1 << 1)
+#define VMODE_16BIT_RGB				(1 << 2)
+
+// Command opcodes live in the low bits of a command word
+#define OPCODE_MASK					0xF
+
+#define VPUCMD_SETVPAGE				0x00000000
+#define VPUCMD_RESERVED				0x00000001
+#define VPUCMD_SETVMODE				0x00000002
+#define VPUCMD_SHIFTCACHE			0x00000003
+#define VPUCMD_SHIFTSCANOUT			0x00000004
+#define VPUCMD_SHIFTPIXEL			0x00000005
+#define VPUCMD_SETVPAGE2			0x00000006
+#define VPUCMD_SYNCSWAP				0x00000007
+#define VPUCMD_WCONTROLREG			0x00000008
+#define VPUCMD_WPROGADDR			0x00000009
+#define VPUCMD_WPROGWORD			0x0000000A
+#define VPUCMD_NOOP					0x000000FF
+
+#define APUCMD_BUFFERSIZE			0x00000000
+#define APUCMD_START				0x00000001
+#define APUCMD_NOOP					0x00000002
+#define APUCMD_SWAPCHANNELS			0x00000003
+#define APUCMD_SETRATE				0x00000004
+
+#define VCPSETBUFFERSIZE			0x0
+#define VCPSTARTDMA					0x1
+#define VCPEXEC						0x2
+#define VCPEXEC_FLAGS_MASK			0xFFFFFFF0
+
+enum EVideoMode { EVM_320_Wide, EVM_640_Wide, EVM_Count };
+enum EColorMode { ECM_8bit_Indexed, ECM_16bit_RGB, ECM_Count };
+enum EVideoScanoutEnable { EVS_Disable, EVS_Enable, EVS_Count };
+enum EAPUSampleRate { ASR_44_100_Hz, ASR_22_050_Hz, ASR_11_025_Hz, ASR_Halt };
+enum ERegisterBlock { ERB_Audio, ERB_Video, ERB_Palette, ERB_VCP, ERB_Count };
+enum ERegisterOp { ERO_Read, ERO_Write, ERO_MaskWrite, ERO_Count };
+enum EMapMode { EMM_Uncached, EMM_WriteCombine, EMM_Cached, EMM_Count };
+enum ECacheOp { ECO_Clean, ECO_Invalidate, ECO_Flush, ECO_Count };
+enum EPaletteLatch { EPL_Immediate, EPL_VBlank, EPL_Count };
+enum EEventType { EET_VBlank, EET_AudioBuffer, EET_Count };
+
+#define EVENT_MASK(_type)	(1u << (_type))
+#define EVENT_MASK_ALL		(EVENT_MASK(EET_Count) - 1)
+
+// User pointers in these are 32 bit, the ABI is that of the 32 bit ARM user space
+struct SPIoctl
+{
+	uint32_t offset;
+	uint32_t value;
+};
+
+struct SPSubmit
+{
+	uint32_t count;
+	uint32_t words;
+};
+
+struct SPRegOp
+{
+	uint32_t block;
+	uint32_t offset;
+	uint32_t value;
+	uint32_t op;
+	uint32_t mask;
+};
+
+struct SPRegProgram
+{
+	uint32_t count;
+	uint32_t ops;
+};
+
+struct SPCacheOp
+{
+	uint32_t offset;
+	uint32_t size;
+	uint32_t op;
+};
+
+struct SPAlloc
+{
+	uint32_t size;
+	uint32_t address;
+};
+
+struct SPExport
+{
+	uint32_t address;
+	uint32_t flags;
+	int32_t fd;
+};
+
+struct SPPalette
+{
+	uint32_t first;
+	uint32_t count;
+	uint32_t entries;
+	uint32_t latch;
+};
+
+struct SPVCPProgram
+{
+	uint32_t size;
+	uint32_t program;
+	uint32_t execflags;
+};
+
+struct SPFifoStatus
+{
+	uint32_t block;
+	uint32_t level;
+	uint32_t space;
+	uint32_t depth;
+	uint32_t overflows;
+};
+
+struct SPRingHeader
+{
+	uint32_t head;
+	uint32_t reserved0[7];
+	uint32_t tail;
+	uint32_t reserved1[7];
+	uint32_t entries;
+	uint32_t errors;
+};
+
+struct SPRingEntry
+{
+	uint32_t sequence;
+	uint32_t block;
+	uint32_t word;
+	uint32_t reserved;
+};
+
+struct SPEvent
+{
+	uint32_t type;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint32_t value;
+	uint32_t reserved;
+};
+
+struct SPEventWait
+{
+	uint32_t mask;
+};
+
+struct SPStatusPage
+{
+	uint32_t sequence;
+	uint32_t vblank_count;
+	uint32_t vblank_sequence;
+	uint32_t swap_sequence;
+	uint64_t vblank_time;
+	uint64_t swap_time;
+	uint32_t audio_count;
+	uint32_t audio_sequence;
+	uint64_t audio_time;
+	uint32_t fifo_level[ERB_Count];
+	uint32_t vcp_status;
+	uint32_t vcp_slot;
+	uint64_t update_time;
+};
+
+#endif
@@ -0,0 +1 @@
+gcc -m32 -O2 -fPIC -shared -I../sdkcommon sandpipersim.c -o libsandpipersim.so -ldl -lpthread
@@ -0,0 +1,1288 @@
+// Host side simulator of the /dev/sandpiper device, see sandpipersim.h
+// Models the driver's ioctl, mmap and read ABI on top of a 32 Mbyte in-memory copy of the reserved region,
+// with command FIFOs that drain at a fixed rate, vblanks at a fixed period and APU buffers that play in real (simulated) time.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "sandpipersim.h"
+#include "sandpiper_abi.h"
+
+#define DEVICE_PATH				"/dev/sandpiper"
+#define DISPLAY_WIDTH			640
+#define DISPLAY_HEIGHT			480
+#define MAX_FILES				16
+#define MAX_ALLOCS				256
+#define APU_QUEUE				4
+#define POOL_PAGES				(POOL_MEMORY_SIZE / SP_PAGE_SIZE)
+
+// Defaults of the timing model, a 60Hz display and FIFOs draining one word per 100MHz fabric clock
+#define DEFAULT_VBLANK_PERIOD	16666667ull
+#define DEFAULT_FIFO_WORD		10ull
+#define DEFAULT_IOCTL_COST		2000ull
+#define DEFAULT_FIFO_DEPTH		512
+
+struct SimFile
+{
+	int fd;					// Descriptor handed to the program, -1 when the slot is free
+	int nonblock;
+	int eventsEnabled;
+	uint32_t eventMask;
+	uint32_t mapMode;
+	uint32_t vblankSeen;
+	uint32_t audioSeen;
+};
+
+struct SimAlloc
+{
+	int fd;					// Owning file, -1 when the slot is free
+	uint32_t address;
+	uint32_t size;
+};
+
+struct SimFifo
+{
+	uint32_t command;		// Command word waiting for its argument
+	int needArg;
+	uint32_t level;			// Words not consumed yet
+	uint64_t drainTime;		// Time the last consumed word left the FIFO
+	uint32_t overflows;
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static int s_initialized = 0;
+static uint8_t *s_memory = NULL;
+static struct SPSimTiming s_timing;
+static struct SPSimStats s_stats;
+static uint64_t s_now = 0;
+static uint64_t s_nextVBlank = 0;
+static char s_dumpDirectory[512];
+static int s_dumpEvery = 0;
+
+static struct SimFile s_files[MAX_FILES];
+static struct SimAlloc s_allocs[MAX_ALLOCS];
+static uint8_t s_poolUsed[POOL_PAGES];
+static struct SimFifo s_fifo[ERB_Count];
+static uint32_t s_ringTail = 0;
+
+// VPU
+static uint32_t s_vmode = 0;
+static uint32_t s_scanout = 0;
+static uint32_t s_pendingPage = 0;
+static int s_pagePending = 0;
+static uint32_t s_palette[PALETTE_ENTRIES];
+static uint32_t s_paletteStaged[PALETTE_ENTRIES];
+static uint8_t s_paletteDirty[PALETTE_ENTRIES];
+static uint32_t s_vblankCount = 0;
+static uint32_t s_vblankSequence = 0;
+static uint64_t s_vblankTime = 0;
+static uint32_t s_swapSequence = 0;
+static uint64_t s_swapTime = 0;
+
+// APU
+static uint32_t s_audioWords = 0;
+static uint32_t s_audioRate = ASR_Halt;
+static uint32_t s_audioQueue[APU_QUEUE];
+static uint32_t s_audioHead = 0;
+static uint32_t s_audioQueued = 0;
+static int s_audioPlaying = 0;
+static uint64_t s_audioEnd = 0;
+static uint32_t s_audioCount = 0;
+static uint32_t s_audioSequence = 0;
+static uint64_t s_audioTime = 0;
+
+// VCP
+static uint32_t s_vcpSlot = 0;
+
+static int (*s_realOpen)(const char *, int, ...);
+static int (*s_realClose)(int);
+static int (*s_realIoctl)(int, unsigned long, ...);
+static void *(*s_realMmap)(void *, size_t, int, int, int, off_t);
+static int (*s_realMunmap)(void *, size_t);
+static ssize_t (*s_realRead)(int, void *, size_t);
+static int (*s_realPoll)(struct pollfd *, nfds_t, int);
+
+static void ResolveLibc(void)
+{
+	if (s_realOpen)
+		return;
+	s_realOpen = dlsym(RTLD_NEXT, "open");
+	s_realClose = dlsym(RTLD_NEXT, "close");
+	s_realIoctl = dlsym(RTLD_NEXT, "ioctl");
+	s_realMmap = dlsym(RTLD_NEXT, "mmap");
+	s_realMunmap = dlsym(RTLD_NEXT, "munmap");
+	s_realRead = dlsym(RTLD_NEXT, "read");
+	s_realPoll = dlsym(RTLD_NEXT, "poll");
+}
+
+static uint64_t EnvOr(const char *name, uint64_t fallback)
+{
+	const char *value = getenv(name);
+	return value && *value ? strtoull(value, NULL, 0) : fallback;
+}
+
+// Callers hold s_lock
+static void SimInit(void)
+{
+	const char *dump;
+
+	if (s_initialized)
+		return;
+	s_initialized = 1;
+
+	s_memory = calloc(1, RESERVED_MEMORY_SIZE);
+	if (!s_memory)
+	{
+		fprintf(stderr, "sandpipersim: can't allocate the reserved memory region\n");
+		abort();
+	}
+
+	s_timing.vblankPeriod = EnvOr("SANDPIPER_SIM_VBLANK_NS", DEFAULT_VBLANK_PERIOD);
+	s_timing.fifoWord = EnvOr("SANDPIPER_SIM_FIFO_WORD_NS", DEFAULT_FIFO_WORD);
+	s_timing.ioctlCost = EnvOr("SANDPIPER_SIM_IOCTL_NS", DEFAULT_IOCTL_COST);
+	s_timing.fifoDepth = (uint32_t)EnvOr("SANDPIPER_SIM_FIFO_DEPTH", DEFAULT_FIFO_DEPTH);
+	s_timing.backpressure = (uint32_t)EnvOr("SANDPIPER_SIM_BACKPRESSURE", 0);
+	if (s_timing.vblankPeriod == 0)
+		s_timing.vblankPeriod = DEFAULT_VBLANK_PERIOD;
+	if (s_timing.fifoDepth == 0)
+		s_timing.fifoDepth = DEFAULT_FIFO_DEPTH;
+	s_nextVBlank = s_timing.vblankPeriod;
+
+	dump = getenv("SANDPIPER_SIM_DUMP");
+	if (dump && *dump)
+		snprintf(s_dumpDirectory, sizeof(s_dumpDirectory), "%s", dump);
+	s_dumpEvery = (int)EnvOr("SANDPIPER_SIM_DUMP_EVERY", 0);
+
+	for (int i = 0; i < MAX_FILES; ++i)
+		s_files[i].fd = -1;
+	for (int i = 0; i < MAX_ALLOCS; ++i)
+		s_allocs[i].fd = -1;
+
+	// The board boots scanning out the console framebuffer
+	s_vmode = MAKEVMODEINFO(1, 1, 1);
+	s_scanout = CONSOLE_FRAMEBUFFER_ADDR;
+
+	((struct SPRingHeader *)(s_memory + (COMMAND_RING_ADDR - PHYS_ADDR)))->entries = COMMAND_RING_ENTRIES;
+}
+
+static struct SimFile *FindFile(int fd)
+{
+	if (fd < 0)
+		return NULL;
+	for (int i = 0; i < MAX_FILES; ++i)
+		if (s_files[i].fd == fd)
+			return &s_files[i];
+	return NULL;
+}
+
+static void *UserPointer(uint32_t address)
+{
+	return (void *)(uintptr_t)address;
+}
+
+// Frames
+
+static uint32_t RGB565ToRGB888(uint16_t pixel)
+{
+	uint32_t r = (pixel >> 11) & 0x1f;
+	uint32_t g = (pixel >> 5) & 0x3f;
+	uint32_t b = pixel & 0x1f;
+	return ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+// Same output as the display, 640x480 with 320 wide modes doubled
+static int WriteFrame(const char *path)
+{
+	int wide = (s_vmode & VMODE_640_WIDE) != 0;
+	int rgb = (s_vmode & VMODE_16BIT_RGB) != 0;
+	uint32_t stride = (wide ? DISPLAY_WIDTH : DISPLAY_WIDTH / 2) * (rgb ? 2 : 1);
+	uint8_t line[DISPLAY_WIDTH * 3];
+	FILE *fp = fopen(path, "wb");
+
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "P6\n%d %d\n255\n", DISPLAY_WIDTH, DISPLAY_HEIGHT);
+	for (int y = 0; y < DISPLAY_HEIGHT; ++y)
+	{
+		uint32_t rowAddress = s_scanout + (wide ? y : y / 2) * stride;
+		const uint8_t *src = NULL;
+
+		if (rowAddress >= PHYS_ADDR && rowAddress - PHYS_ADDR + stride <= RESERVED_MEMORY_SIZE)
+			src = s_memory + (rowAddress - PHYS_ADDR);
+
+		for (int x = 0; x < DISPLAY_WIDTH; ++x)
+		{
+			int sx = wide ? x : x / 2;
+			uint32_t color = 0;
+
+			if (src && (s_vmode & VMODE_SCAN_ENABLE))
+				color = rgb ? RGB565ToRGB888(src[sx * 2] | (src[sx * 2 + 1] << 8)) : (s_palette[src[sx]] & 0x00ffffff);
+
+			line[x * 3 + 0] = color >> 16;
+			line[x * 3 + 1] = color >> 8;
+			line[x * 3 + 2] = color;
+		}
+		fwrite(line, 1, sizeof(line), fp);
+	}
+
+	return fclose(fp);
+}
+
+// Simulated time
+
+static void AudioStartNext(void)
+{
+	s_audioPlaying = 0;
+	if (s_audioQueued == 0 || s_audioRate == ASR_Halt)
+		return;
+
+	static const uint32_t rates[] = { 44100, 22050, 11025 };
+	s_audioQueued--;
+	s_audioPlaying = 1;
+	// One 32 bit word per stereo frame
+	s_audioEnd = s_now + (uint64_t)s_audioWords * 1000000000ull / rates[s_audioRate];
+}
+
+static void AudioBufferDone(void)
+{
+	s_audioCount++;
+	s_audioSequence++;
+	s_audioTime = s_now;
+	s_stats.audioBuffers++;
+	s_audioHead = (s_audioHead + 1) % APU_QUEUE;
+	AudioStartNext();
+}
+
+static void VBlank(void)
+{
+	int swapped = 0;
+
+	if (s_pagePending)
+	{
+		s_scanout = s_pendingPage;
+		s_pagePending = 0;
+		s_swapSequence++;
+		s_swapTime = s_now;
+		s_stats.swaps++;
+		swapped = 1;
+	}
+
+	for (int i = 0; i < PALETTE_ENTRIES; ++i)
+	{
+		if (s_paletteDirty[i])
+		{
+			s_palette[i] = s_paletteStaged[i];
+			s_paletteDirty[i] = 0;
+		}
+	}
+
+	s_vblankCount++;
+	s_vblankSequence++;
+	s_vblankTime = s_now;
+	s_stats.vblanks++;
+	s_nextVBlank += s_timing.vblankPeriod;
+
+	if (s_dumpDirectory[0] && (swapped || s_dumpEvery))
+	{
+		char path[600];
+		snprintf(path, sizeof(path), "%s/frame_%06u.ppm", s_dumpDirectory, s_vblankCount);
+		if (WriteFrame(path) == 0)
+			s_stats.framesDumped++;
+	}
+}
+
+static void UpdateStatusPage(void)
+{
+	struct SPStatusPage *status = (struct SPStatusPage *)(s_memory + (STATUS_PAGE_ADDR - PHYS_ADDR));
+	uint32_t sequence = status->sequence;
+
+	__atomic_store_n(&status->sequence, sequence + 1, __ATOMIC_RELEASE);
+	status->vblank_count = s_vblankCount;
+	status->vblank_sequence = s_vblankSequence;
+	status->swap_sequence = s_swapSequence;
+	status->vblank_time = s_vblankTime;
+	status->swap_time = s_swapTime;
+	status->audio_count = s_audioCount;
+	status->audio_sequence = s_audioSequence;
+	status->audio_time = s_audioTime;
+	for (int i = 0; i < ERB_Count; ++i)
+		status->fifo_level[i] = s_fifo[i].level;
+	status->vcp_status = 0;
+	status->vcp_slot = s_vcpSlot;
+	status->update_time = s_now;
+	__atomic_store_n(&status->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Let simulated time pass up to target, handling every vblank and audio buffer on the way
+static void RunUntil(uint64_t target)
+{
+	for (;;)
+	{
+		int audio = s_audioPlaying && s_audioEnd <= s_nextVBlank;
+		uint64_t next = audio ? s_audioEnd : s_nextVBlank;
+
+		if (next > target)
+			break;
+		if (next > s_now)
+			s_now = next;
+
+		if (audio)
+			AudioBufferDone();
+		else
+			VBlank();
+	}
+
+	if (target > s_now)
+		s_now = target;
+
+	UpdateStatusPage();
+}
+
+// Command FIFOs
+
+static void FifoDrain(uint32_t block)
+{
+	struct SimFifo *fifo = &s_fifo[block];
+	uint64_t drained;
+
+	if (fifo->level == 0 || s_timing.fifoWord == 0)
+	{
+		fifo->level = 0;
+		fifo->drainTime = s_now;
+		return;
+	}
+
+	drained = (s_now - fifo->drainTime) / s_timing.fifoWord;
+	if (drained >= fifo->level)
+	{
+		fifo->level = 0;
+		fifo->drainTime = s_now;
+	}
+	else
+	{
+		fifo->level -= (uint32_t)drained;
+		fifo->drainTime += drained * s_timing.fifoWord;
+	}
+}
+
+// Make room for count words, count is at most the FIFO depth
+// Like the driver this only waits with backpressure on, otherwise words that don't fit count as overflows as the board would lose them
+static void FifoReserve(uint32_t block, uint32_t count)
+{
+	struct SimFifo *fifo = &s_fifo[block];
+
+	FifoDrain(block);
+	if (fifo->level + count > s_timing.fifoDepth)
+	{
+		uint64_t wait = (uint64_t)(fifo->level + count - s_timing.fifoDepth) * s_timing.fifoWord - (s_now - fifo->drainTime);
+
+		fifo->overflows++;
+		s_stats.fifoOverflows++;
+		if (!s_timing.backpressure)
+		{
+			fifo->level = s_timing.fifoDepth;
+			return;
+		}
+
+		s_stats.fifoStallTime += wait;
+		RunUntil(s_now + wait);
+		FifoDrain(block);
+	}
+
+	fifo->level += count;
+}
+
+static int CommandHasArg(uint32_t block, uint32_t opcode)
+{
+	switch (block)
+	{
+		case ERB_Video: return opcode != VPUCMD_SYNCSWAP && opcode != VPUCMD_WCONTROLREG && opcode <= VPUCMD_WPROGWORD;
+		case ERB_Audio: return opcode != APUCMD_NOOP && opcode <= APUCMD_SETRATE;
+		case ERB_VCP: return opcode == VCPSETBUFFERSIZE || opcode == VCPSTARTDMA;
+		default: return 0;
+	}
+}
+
+static void ExecuteCommand(uint32_t block, uint32_t command, uint32_t arg)
+{
+	uint32_t opcode = command & OPCODE_MASK;
+
+	if (block == ERB_Video)
+	{
+		if (opcode == VPUCMD_SETVPAGE)
+		{
+			s_pendingPage = arg;
+			s_pagePending = 1;
+		}
+		else if (opcode == VPUCMD_SETVMODE)
+			s_vmode = arg;
+	}
+	else if (block == ERB_Audio)
+	{
+		switch (opcode)
+		{
+			case APUCMD_BUFFERSIZE:
+				s_audioWords = arg;
+				break;
+			case APUCMD_START:
+				if (s_audioQueued + (s_audioPlaying ? 1 : 0) >= APU_QUEUE)
+					break;
+				s_audioQueue[(s_audioHead + s_audioQueued + (s_audioPlaying ? 1 : 0)) % APU_QUEUE] = arg;
+				s_audioQueued++;
+				if (!s_audioPlaying)
+					AudioStartNext();
+				break;
+			case APUCMD_SETRATE:
+				s_audioRate = arg & 3;
+				if (s_audioRate == ASR_Halt)
+				{
+					s_audioQueued = 0;
+					s_audioPlaying = 0;
+				}
+				else if (!s_audioPlaying)
+					AudioStartNext();
+				break;
+		}
+	}
+	// VCP programs are accepted but not executed
+}
+
+static void FifoWrite(uint32_t block, uint32_t word)
+{
+	struct SimFifo *fifo = &s_fifo[block];
+
+	s_stats.fifoWords[block]++;
+	if (fifo->needArg)
+	{
+		fifo->needArg = 0;
+		ExecuteCommand(block, fifo->command, word);
+	}
+	else if (CommandHasArg(block, word & OPCODE_MASK))
+	{
+		fifo->command = word;
+		fifo->needArg = 1;
+	}
+	else
+		ExecuteCommand(block, word, 0);
+}
+
+static int HasFifo(uint32_t block)
+{
+	return block == ERB_Audio || block == ERB_Video || block == ERB_VCP;
+}
+
+static uint32_t RegisterRead(uint32_t block, uint32_t offset)
+{
+	if (block == ERB_Palette)
+		return s_palette[offset % PALETTE_ENTRIES];
+
+	if (offset == FIFO_LEVEL_OFFSET)
+	{
+		FifoDrain(block);
+		return s_fifo[block].level;
+	}
+	if (block == ERB_Video && offset == VIDEO_STATUS_OFFSET)
+		return s_vblankCount;
+	if (block == ERB_Audio && offset == AUDIO_STATUS_OFFSET)
+		return s_audioCount;
+	return 0;
+}
+
+static void RegisterWrite(uint32_t block, uint32_t offset, uint32_t value)
+{
+	if (block == ERB_Palette)
+	{
+		s_palette[offset % PALETTE_ENTRIES] = value;
+		s_stats.fifoWords[ERB_Palette]++;
+	}
+	else
+	{
+		FifoReserve(block, 1);
+		FifoWrite(block, value);
+	}
+}
+
+static int Submit(uint32_t block, const uint32_t *words, uint32_t count, int nonblock)
+{
+	// Same up front check as the driver, a non-blocking list goes in whole or not at all
+	if (nonblock && s_timing.backpressure)
+	{
+		if (count > s_timing.fifoDepth)
+			return -EINVAL;
+		FifoDrain(block);
+		if (s_fifo[block].level + count > s_timing.fifoDepth)
+		{
+			s_fifo[block].overflows++;
+			s_stats.fifoOverflows++;
+			return -EAGAIN;
+		}
+	}
+
+	while (count)
+	{
+		uint32_t n = count < s_timing.fifoDepth ? count : s_timing.fifoDepth;
+		FifoReserve(block, n);
+		for (uint32_t i = 0; i < n; ++i)
+			FifoWrite(block, words[i]);
+		words += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static void RingDrain(void)
+{
+	struct SPRingHeader *header = (struct SPRingHeader *)(s_memory + (COMMAND_RING_ADDR - PHYS_ADDR));
+	struct SPRingEntry *entries = (struct SPRingEntry *)((uint8_t *)header + SP_PAGE_SIZE);
+
+	for (;;)
+	{
+		struct SPRingEntry *entry = &entries[s_ringTail & (COMMAND_RING_ENTRIES - 1)];
+		if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != s_ringTail + 1)
+			break;
+		if (HasFifo(entry->block))
+		{
+			FifoReserve(entry->block, 1);
+			FifoWrite(entry->block, entry->word);
+		}
+		else
+			header->errors++;
+		s_ringTail++;
+	}
+	__atomic_store_n(&header->tail, s_ringTail, __ATOMIC_RELEASE);
+}
+
+// Events
+
+static void EventsEnable(struct SimFile *file)
+{
+	if (file->eventsEnabled)
+		return;
+	file->eventsEnabled = 1;
+	file->vblankSeen = s_vblankSequence;
+	file->audioSeen = s_audioSequence;
+}
+
+static int EventsPending(struct SimFile *file)
+{
+	return ((file->eventMask & EVENT_MASK(EET_VBlank)) && file->vblankSeen != s_vblankSequence) ||
+		((file->eventMask & EVENT_MASK(EET_AudioBuffer)) && file->audioSeen != s_audioSequence);
+}
+
+// Time of the next event the file waits for, 0 if nothing it wants can ever happen
+static uint64_t NextEventTime(struct SimFile *file)
+{
+	uint64_t next = 0;
+	if (file->eventMask & EVENT_MASK(EET_VBlank))
+		next = s_nextVBlank;
+	if ((file->eventMask & EVENT_MASK(EET_AudioBuffer)) && s_audioPlaying && (next == 0 || s_audioEnd < next))
+		next = s_audioEnd;
+	return next;
+}
+
+static size_t EventsCollect(struct SimFile *file, struct SPEvent *events, size_t max)
+{
+	size_t count = 0;
+
+	if (count < max && (file->eventMask & EVENT_MASK(EET_VBlank)) && file->vblankSeen != s_vblankSequence)
+	{
+		file->vblankSeen = s_vblankSequence;
+		events[count].type = EET_VBlank;
+		events[count].sequence = s_vblankSequence;
+		events[count].timestamp = s_vblankTime;
+		events[count].value = s_vblankCount;
+		events[count].reserved = 0;
+		count++;
+	}
+	if (count < max && (file->eventMask & EVENT_MASK(EET_AudioBuffer)) && file->audioSeen != s_audioSequence)
+	{
+		file->audioSeen = s_audioSequence;
+		events[count].type = EET_AudioBuffer;
+		events[count].sequence = s_audioSequence;
+		events[count].timestamp = s_audioTime;
+		events[count].value = s_audioCount;
+		events[count].reserved = 0;
+		count++;
+	}
+
+	return count;
+}
+
+// Allocations
+
+static int AllocPages(struct SimFile *file, struct SPAlloc *alloc)
+{
+	uint32_t pages = (alloc->size + SP_PAGE_SIZE - 1) / SP_PAGE_SIZE;
+	uint32_t run = 0;
+	int slot = -1;
+
+	if (pages == 0)
+		return -EINVAL;
+
+	for (int i = 0; i < MAX_ALLOCS && slot < 0; ++i)
+		if (s_allocs[i].fd < 0)
+			slot = i;
+	if (slot < 0)
+		return -ENOMEM;
+
+	for (uint32_t page = 0; page < POOL_PAGES; ++page)
+	{
+		run = s_poolUsed[page] ? 0 : run + 1;
+		if (run == pages)
+		{
+			uint32_t first = page + 1 - pages;
+			memset(&s_poolUsed[first], 1, pages);
+			s_allocs[slot].fd = file->fd;
+			s_allocs[slot].address = POOL_MEMORY_ADDR + first * SP_PAGE_SIZE;
+			s_allocs[slot].size = pages * SP_PAGE_SIZE;
+			alloc->size = s_allocs[slot].size;
+			alloc->address = s_allocs[slot].address;
+			return 0;
+		}
+	}
+
+	return -ENOMEM;
+}
+
+static void FreeSlot(struct SimAlloc *alloc)
+{
+	memset(&s_poolUsed[(alloc->address - POOL_MEMORY_ADDR) / SP_PAGE_SIZE], 0, alloc->size / SP_PAGE_SIZE);
+	alloc->fd = -1;
+}
+
+static struct SimAlloc *FindAlloc(int fd, uint32_t address, uint32_t size)
+{
+	for (int i = 0; i < MAX_ALLOCS; ++i)
+	{
+		struct SimAlloc *alloc = &s_allocs[i];
+		if (alloc->fd == fd && address >= alloc->address && address - alloc->address < alloc->size && size <= alloc->size - (address - alloc->address))
+			return alloc;
+	}
+	return NULL;
+}
+
+// ioctl
+
+static uint32_t IoctlBlock(unsigned long cmd)
+{
+	switch (cmd)
+	{
+		case SP_IOCTL_AUDIO_READ: case SP_IOCTL_AUDIO_WRITE: return ERB_Audio;
+		case SP_IOCTL_VIDEO_READ: case SP_IOCTL_VIDEO_WRITE: return ERB_Video;
+		case SP_IOCTL_PALETTE_READ: case SP_IOCTL_PALETTE_WRITE: return ERB_Palette;
+		default: return ERB_VCP;
+	}
+}
+
+static int SimIoctl(struct SimFile *file, unsigned long cmd, void *arg)
+{
+	struct SPIoctl *data = arg;
+
+	s_stats.ioctls++;
+	RunUntil(s_now + s_timing.ioctlCost);
+
+	switch (cmd)
+	{
+		case SP_IOCTL_GET_AUDIO_CTL: data->value = AUDIO_CTRL_REGS_ADDR; return 0;
+		case SP_IOCTL_GET_VIDEO_CTL: data->value = VIDEO_CTRL_REGS_ADDR; return 0;
+		case SP_IOCTL_GET_PALETTE_CTL: data->value = PALETTE_CTRL_REGS_ADDR; return 0;
+		case SP_IOCTL_GET_VCP_CTL: data->value = VCP_CTRL_REGS_ADDR; return 0;
+
+		case SP_IOCTL_AUDIO_READ:
+		case SP_IOCTL_VIDEO_READ:
+		case SP_IOCTL_PALETTE_READ:
+		case SP_IOCTL_VCP_READ:
+			if (data->offset >= DEVICE_MEMORY_SIZE / sizeof(uint32_t))
+				return -EINVAL;
+			data->value = RegisterRead(IoctlBlock(cmd), data->offset);
+			return 0;
+
+		case SP_IOCTL_AUDIO_WRITE:
+		case SP_IOCTL_VIDEO_WRITE:
+		case SP_IOCTL_PALETTE_WRITE:
+		case SP_IOCTL_VCP_WRITE:
+			if (data->offset >= DEVICE_MEMORY_SIZE / sizeof(uint32_t))
+				return -EINVAL;
+			RegisterWrite(IoctlBlock(cmd), data->offset, data->value);
+			return 0;
+
+		case SP_IOCTL_VPU_SUBMIT:
+		{
+			struct SPSubmit *submit = arg;
+			return Submit(ERB_Video, UserPointer(submit->words), submit->count, file->nonblock);
+		}
+
+		case SP_IOCTL_REG_PROGRAM:
+		{
+			struct SPRegProgram *program = arg;
+			struct SPRegOp *ops = UserPointer(program->ops);
+			for (uint32_t i = 0; i < program->count; ++i)
+				if (ops[i].block >= ERB_Count || ops[i].op >= ERO_Count || ops[i].offset >= DEVICE_MEMORY_SIZE / sizeof(uint32_t))
+					return -EINVAL;
+			for (uint32_t i = 0; i < program->count; ++i)
+			{
+				if (ops[i].op == ERO_Read)
+					ops[i].value = RegisterRead(ops[i].block, ops[i].offset);
+				else if (ops[i].op == ERO_Write)
+					RegisterWrite(ops[i].block, ops[i].offset, ops[i].value);
+				else
+				{
+					uint32_t prev = RegisterRead(ops[i].block, ops[i].offset);
+					RegisterWrite(ops[i].block, ops[i].offset, (prev & ~ops[i].mask) | (ops[i].value & ops[i].mask));
+					ops[i].value = prev;
+				}
+			}
+			return 0;
+		}
+
+		case SP_IOCTL_SET_MAP_MODE:
+			if (data->value >= EMM_Count)
+				return -EINVAL;
+			file->mapMode = data->value;
+			return 0;
+
+		case SP_IOCTL_CACHE_SYNC:
+		{
+			// Host memory is coherent, only the arguments are checked, and like the driver only cached files may sync
+			struct SPCacheOp *op = arg;
+			if (file->mapMode != EMM_Cached)
+				return -EINVAL;
+			return op->op < ECO_Count && op->offset < RESERVED_MEMORY_SIZE && op->size <= RESERVED_MEMORY_SIZE - op->offset ? 0 : -EINVAL;
+		}
+
+		case SP_IOCTL_SET_EVENT_MASK:
+		{
+			uint32_t enabled = data->value & ~file->eventMask;
+			if (data->value & ~EVENT_MASK_ALL)
+				return -EINVAL;
+			if (enabled & EVENT_MASK(EET_VBlank))
+				file->vblankSeen = s_vblankSequence;
+			if (enabled & EVENT_MASK(EET_AudioBuffer))
+				file->audioSeen = s_audioSequence;
+			file->eventMask = data->value;
+			return 0;
+		}
+
+		case SP_IOCTL_ALLOC:
+			return AllocPages(file, arg);
+
+		case SP_IOCTL_FREE:
+		{
+			struct SPAlloc *alloc = arg;
+			struct SimAlloc *owned = FindAlloc(file->fd, alloc->address, 1);
+			if (!owned || owned->address != alloc->address)
+				return -EINVAL;
+			FreeSlot(owned);
+			return 0;
+		}
+
+		case SP_IOCTL_EXPORT:
+			// There are no dma-bufs to hand out on the host
+			return -ENOSYS;
+
+		case SP_IOCTL_PALETTE_LOAD:
+		{
+			struct SPPalette *palette = arg;
+			const uint32_t *entries = UserPointer(palette->entries);
+			if (palette->latch >= EPL_Count || palette->first >= PALETTE_ENTRIES || palette->count == 0 || palette->count > PALETTE_ENTRIES - palette->first)
+				return -EINVAL;
+			for (uint32_t i = 0; i < palette->count; ++i)
+			{
+				if (palette->latch == EPL_Immediate)
+					s_palette[palette->first + i] = entries[i];
+				else
+				{
+					s_paletteStaged[palette->first + i] = entries[i];
+					s_paletteDirty[palette->first + i] = 1;
+				}
+			}
+			s_stats.fifoWords[ERB_Palette] += palette->count;
+			return 0;
+		}
+
+		case SP_IOCTL_VCP_LOAD:
+		{
+			struct SPVCPProgram *program = arg;
+			uint32_t offset = VCP_PROGRAM_ADDR - PHYS_ADDR + s_vcpSlot * VCP_PROGRAM_SLOT_SIZE;
+			uint32_t words[5];
+			if (program->size == 0 || program->size > VCP_PROGRAM_SLOT_SIZE || (program->size & 3))
+				return -EINVAL;
+			if (program->execflags & ~VCPEXEC_FLAGS_MASK)
+				return -EINVAL;
+			memcpy(s_memory + offset, UserPointer(program->program), program->size);
+			words[0] = VCPSETBUFFERSIZE;
+			words[1] = program->size / sizeof(uint32_t);
+			words[2] = VCPSTARTDMA;
+			words[3] = PHYS_ADDR + offset;
+			words[4] = VCPEXEC | program->execflags;
+			s_vcpSlot = (s_vcpSlot + 1) % VCP_PROGRAM_SLOTS;
+			return Submit(ERB_VCP, words, 5, 0);
+		}
+
+		case SP_IOCTL_RING_DOORBELL:
+			RingDrain();
+			return 0;
+
+		case SP_IOCTL_FIFO_STATUS:
+		{
+			struct SPFifoStatus *status = arg;
+			if (!HasFifo(status->block))
+				return -EINVAL;
+			// The driver reports an empty FIFO when it isn't watching the level
+			FifoDrain(status->block);
+			status->level = s_timing.backpressure ? s_fifo[status->block].level : 0;
+			status->space = s_timing.fifoDepth - status->level;
+			status->depth = s_timing.fifoDepth;
+			status->overflows = s_fifo[status->block].overflows;
+			return 0;
+		}
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+// Last close replays the driver's reset stream: display back on the console with scrolling and control
+// registers cleared, units stopped, and the command ring emptied for the next client
+static void ReleaseDevice(void)
+{
+	uint32_t video[11] = {
+		VPUCMD_SETVPAGE, CONSOLE_FRAMEBUFFER_ADDR,
+		VPUCMD_SETVMODE, MAKEVMODEINFO(1, 1, 1),
+		VPUCMD_WCONTROLREG | 0,
+		VPUCMD_SHIFTCACHE, 0,
+		VPUCMD_SHIFTSCANOUT, 0,
+		VPUCMD_SHIFTPIXEL, 0 };
+	uint32_t halt[2] = { APUCMD_SETRATE, ASR_Halt };
+	uint32_t vcp[1] = { VCPEXEC | 0 };
+	struct SPRingHeader *header = (struct SPRingHeader *)(s_memory + (COMMAND_RING_ADDR - PHYS_ADDR));
+
+	Submit(ERB_Video, video, 11, 0);
+	Submit(ERB_Audio, halt, 2, 0);
+	Submit(ERB_VCP, vcp, 1, 0);
+
+	memset(header, 0, COMMAND_RING_SIZE);
+	header->entries = COMMAND_RING_ENTRIES;
+	s_ringTail = 0;
+}
+
+// libc replacements
+
+static int OpenDevice(int flags)
+{
+	int slot = -1;
+	int fd;
+
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	for (int i = 0; i < MAX_FILES && slot < 0; ++i)
+		if (s_files[i].fd < 0)
+			slot = i;
+	if (slot < 0)
+	{
+		pthread_mutex_unlock(&s_lock);
+		errno = EMFILE;
+		return -1;
+	}
+
+	// A real descriptor keeps the number unique and lets close() work on it
+	fd = s_realOpen("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+	if (fd >= 0)
+	{
+		memset(&s_files[slot], 0, sizeof(s_files[slot]));
+		s_files[slot].fd = fd;
+		s_files[slot].nonblock = (flags & O_NONBLOCK) != 0;
+		s_files[slot].eventMask = EVENT_MASK(EET_VBlank);
+	}
+	pthread_mutex_unlock(&s_lock);
+
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	ResolveLibc();
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+
+	if (strcmp(path, DEVICE_PATH) == 0)
+		return OpenDevice(flags);
+
+	return s_realOpen(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+
+	return open(path, flags | O_LARGEFILE, mode);
+}
+
+int close(int fd)
+{
+	struct SimFile *file;
+
+	ResolveLibc();
+	pthread_mutex_lock(&s_lock);
+	file = FindFile(fd);
+	if (file)
+	{
+		int users = 0;
+
+		for (int i = 0; i < MAX_ALLOCS; ++i)
+			if (s_allocs[i].fd == fd)
+				FreeSlot(&s_allocs[i]);
+		file->fd = -1;
+
+		for (int i = 0; i < MAX_FILES; ++i)
+			users += s_files[i].fd >= 0;
+		if (users == 0)
+			ReleaseDevice();
+	}
+	pthread_mutex_unlock(&s_lock);
+
+	return s_realClose(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct SimFile *file;
+	va_list args;
+	void *arg;
+	int ret;
+
+	ResolveLibc();
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	pthread_mutex_lock(&s_lock);
+	file = FindFile(fd);
+	if (!file)
+	{
+		pthread_mutex_unlock(&s_lock);
+		return s_realIoctl(fd, request, arg);
+	}
+	ret = SimIoctl(file, request, arg);
+	pthread_mutex_unlock(&s_lock);
+
+	if (ret < 0)
+	{
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	struct SimFile *file;
+	uint32_t physical = (uint32_t)offset;
+	void *result = MAP_FAILED;
+	int error = EINVAL;
+
+	ResolveLibc();
+	pthread_mutex_lock(&s_lock);
+	file = FindFile(fd);
+	if (!file)
+	{
+		pthread_mutex_unlock(&s_lock);
+		return s_realMmap(addr, length, prot, flags, fd, offset);
+	}
+
+	if (physical == PHYS_ADDR && length <= RESERVED_MEMORY_SIZE)
+		result = s_memory;
+	else if (physical == COMMAND_RING_ADDR && length <= COMMAND_RING_SIZE + SP_PAGE_SIZE - 1)
+		result = s_memory + (physical - PHYS_ADDR);
+	else if (physical == STATUS_PAGE_ADDR && length <= SP_PAGE_SIZE)
+	{
+		if (prot & PROT_WRITE)
+			error = EPERM;
+		else
+		{
+			EventsEnable(file);
+			result = s_memory + (physical - PHYS_ADDR);
+		}
+	}
+	else if (FindAlloc(fd, physical, (uint32_t)length))
+		result = s_memory + (physical - PHYS_ADDR);
+	else if (physical == AUDIO_CTRL_REGS_ADDR || physical == VIDEO_CTRL_REGS_ADDR || physical == PALETTE_CTRL_REGS_ADDR || physical == VCP_CTRL_REGS_ADDR)
+		error = EPERM;	// Stores to a plain memory mapping can't be seen, so direct register access isn't simulated
+	pthread_mutex_unlock(&s_lock);
+
+	if (result == MAP_FAILED)
+		errno = error;
+	return result;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+	return mmap(addr, length, prot, flags, fd, (off_t)offset);
+}
+
+int munmap(void *addr, size_t length)
+{
+	ResolveLibc();
+
+	// Device mappings all point into the simulated region, which stays allocated
+	if (s_memory && (uint8_t *)addr >= s_memory && (uint8_t *)addr < s_memory + RESERVED_MEMORY_SIZE)
+		return 0;
+
+	return s_realMunmap(addr, length);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	struct SimFile *file;
+	size_t num = 0;
+
+	ResolveLibc();
+	pthread_mutex_lock(&s_lock);
+	file = FindFile(fd);
+	if (!file)
+	{
+		pthread_mutex_unlock(&s_lock);
+		return s_realRead(fd, buf, count);
+	}
+
+	if (count < sizeof(struct SPEvent))
+	{
+		pthread_mutex_unlock(&s_lock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	RunUntil(s_now + s_timing.ioctlCost);
+	EventsEnable(file);
+
+	// Blocking reads jump straight to the next event instead of sleeping
+	while (!EventsPending(file))
+	{
+		uint64_t next = NextEventTime(file);
+		if (file->nonblock || next == 0)
+		{
+			pthread_mutex_unlock(&s_lock);
+			errno = file->nonblock ? EAGAIN : EDEADLK;
+			return -1;
+		}
+		RunUntil(next);
+	}
+
+	num = EventsCollect(file, buf, count / sizeof(struct SPEvent));
+	pthread_mutex_unlock(&s_lock);
+
+	return num * sizeof(struct SPEvent);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct pollfd others[64];
+	nfds_t otherCount = 0;
+	nfds_t simCount = 0;
+	int ready = 0;
+
+	ResolveLibc();
+	pthread_mutex_lock(&s_lock);
+	for (nfds_t i = 0; i < nfds; ++i)
+	{
+		fds[i].revents = 0;
+		if (FindFile(fds[i].fd))
+			simCount++;
+		else if (otherCount < 64)
+			others[otherCount++] = fds[i];
+	}
+	pthread_mutex_unlock(&s_lock);
+
+	if (simCount == 0)
+		return s_realPoll(fds, nfds, timeout);
+
+	for (;;)
+	{
+		uint64_t next = 0;
+
+		// Other descriptors are checked without waiting, simulated time stands in for the timeout
+		if (otherCount && s_realPoll(others, otherCount, 0) > 0)
+		{
+			for (nfds_t i = 0, j = 0; i < nfds && j < otherCount; ++i)
+				if (fds[i].fd == others[j].fd)
+					fds[i].revents = others[j++].revents;
+		}
+
+		pthread_mutex_lock(&s_lock);
+		RunUntil(s_now + s_timing.ioctlCost);
+		for (nfds_t i = 0; i < nfds; ++i)
+		{
+			struct SimFile *file = FindFile(fds[i].fd);
+			if (!file)
+				continue;
+			EventsEnable(file);
+			if (EventsPending(file))
+				fds[i].revents = fds[i].events & (POLLIN | POLLRDNORM);
+			else
+			{
+				uint64_t fileNext = NextEventTime(file);
+				if (fileNext && (next == 0 || fileNext < next))
+					next = fileNext;
+			}
+		}
+
+		ready = 0;
+		for (nfds_t i = 0; i < nfds; ++i)
+			ready += fds[i].revents != 0;
+
+		if (ready || timeout == 0 || next == 0)
+		{
+			pthread_mutex_unlock(&s_lock);
+			return ready;
+		}
+
+		if (timeout > 0)
+		{
+			uint64_t deadline = s_now + (uint64_t)timeout * 1000000ull;
+			if (next > deadline)
+			{
+				RunUntil(deadline);
+				pthread_mutex_unlock(&s_lock);
+				return 0;
+			}
+		}
+		RunUntil(next);
+		pthread_mutex_unlock(&s_lock);
+	}
+}
+
+// Control API
+
+void SPSimGetTiming(struct SPSimTiming *timing)
+{
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	*timing = s_timing;
+	pthread_mutex_unlock(&s_lock);
+}
+
+void SPSimSetTiming(const struct SPSimTiming *timing)
+{
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	s_timing = *timing;
+	if (s_timing.vblankPeriod == 0)
+		s_timing.vblankPeriod = DEFAULT_VBLANK_PERIOD;
+	if (s_timing.fifoDepth == 0)
+		s_timing.fifoDepth = DEFAULT_FIFO_DEPTH;
+	s_nextVBlank = s_vblankTime + s_timing.vblankPeriod;
+	if (s_nextVBlank <= s_now)
+		s_nextVBlank = s_now + s_timing.vblankPeriod;
+	pthread_mutex_unlock(&s_lock);
+}
+
+void SPSimSetDumpDirectory(const char *directory, int everyVBlank)
+{
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	snprintf(s_dumpDirectory, sizeof(s_dumpDirectory), "%s", directory ? directory : "");
+	s_dumpEvery = everyVBlank;
+	pthread_mutex_unlock(&s_lock);
+}
+
+int SPSimDumpFrame(const char *path)
+{
+	int ret;
+
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	ret = WriteFrame(path);
+	pthread_mutex_unlock(&s_lock);
+
+	return ret;
+}
+
+uint64_t SPSimTime(void)
+{
+	uint64_t now;
+
+	pthread_mutex_lock(&s_lock);
+	now = s_now;
+	pthread_mutex_unlock(&s_lock);
+
+	return now;
+}
+
+void SPSimAdvance(uint64_t nanoseconds)
+{
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	RunUntil(s_now + nanoseconds);
+	pthread_mutex_unlock(&s_lock);
+}
+
+uint8_t *SPSimMemory(void)
+{
+	uint8_t *memory;
+
+	pthread_mutex_lock(&s_lock);
+	SimInit();
+	memory = s_memory;
+	pthread_mutex_unlock(&s_lock);
+
+	return memory;
+}
+
+void SPSimGetStats(struct SPSimStats *stats)
+{
+	pthread_mutex_lock(&s_lock);
+	*stats = s_stats;
+	pthread_mutex_unlock(&s_lock);
+}
+
+void SPSimPrintStats(FILE *out)
+{
+	struct SPSimStats stats;
+	uint64_t now;
+
+	pthread_mutex_lock(&s_lock);
+	stats = s_stats;
+	now = s_now;
+	pthread_mutex_unlock(&s_lock);
+
+	fprintf(out, "simulated time   %.3f ms\n", now / 1e6);
+	fprintf(out, "ioctls           %llu\n", (unsigned long long)stats.ioctls);
+	fprintf(out, "words audio      %llu\n", (unsigned long long)stats.fifoWords[ERB_Audio]);
+	fprintf(out, "words video      %llu\n", (unsigned long long)stats.fifoWords[ERB_Video]);
+	fprintf(out, "words palette    %llu\n", (unsigned long long)stats.fifoWords[ERB_Palette]);
+	fprintf(out, "words vcp        %llu\n", (unsigned long long)stats.fifoWords[ERB_VCP]);
+	fprintf(out, "fifo stall       %.3f ms\n", stats.fifoStallTime / 1e6);
+	fprintf(out, "fifo overflows   %llu\n", (unsigned long long)stats.fifoOverflows);
+	fprintf(out, "vblanks          %llu\n", (unsigned long long)stats.vblanks);
+	fprintf(out, "swaps            %llu\n", (unsigned long long)stats.swaps);
+	fprintf(out, "audio buffers    %llu\n", (unsigned long long)stats.audioBuffers);
+	fprintf(out, "frames dumped    %llu\n", (unsigned long long)stats.framesDumped);
+}
@@ -0,0 +1,65 @@
+// Host side simulator of the /dev/sandpiper device
+// Linking against libsandpipersim (or preloading it) replaces open/close/ioctl/mmap/munmap/read/poll
+// for "/dev/sandpiper" with an in-memory model of the driver and hardware, everything else goes to libc.
+// Time is simulated: it only moves with the work the program does and the events it waits for,
+// so the same program produces the same frames and timings on every run.
+
+#ifndef SANDPIPERSIM_H
+#define SANDPIPERSIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Timing model, all times in nanoseconds of simulated time
+struct SPSimTiming
+{
+	uint64_t vblankPeriod;	// Time between two vblanks
+	uint64_t fifoWord;		// Time a unit takes to consume one command FIFO word
+	uint64_t ioctlCost;		// Fixed cost of one ioctl, read or poll call
+	uint32_t fifoDepth;		// Command FIFO size in words
+	uint32_t backpressure;	// Submits wait for FIFO space, as the driver does with fifo_backpressure=1
+};
+
+struct SPSimStats
+{
+	uint64_t ioctls;			// ioctl calls on the device
+	uint64_t fifoWords[4];		// Words written to each block (ERegisterBlock order)
+	uint64_t fifoStallTime;		// Simulated time spent waiting for FIFO space
+	uint64_t fifoOverflows;		// Submits that found a FIFO full
+	uint64_t vblanks;			// Vblanks simulated so far
+	uint64_t swaps;				// Vblanks that latched a new scanout page
+	uint64_t audioBuffers;		// APU buffers finished
+	uint64_t framesDumped;		// Frames written by the frame dumper
+};
+
+// Defaults come from SANDPIPER_SIM_VBLANK_NS, SANDPIPER_SIM_FIFO_WORD_NS, SANDPIPER_SIM_IOCTL_NS, SANDPIPER_SIM_FIFO_DEPTH
+// and SANDPIPER_SIM_BACKPRESSURE
+void SPSimGetTiming(struct SPSimTiming *timing);
+void SPSimSetTiming(const struct SPSimTiming *timing);
+
+// Dump a PPM image of the scanout into directory at every swap, or at every vblank when everyVBlank is set
+// Defaults come from SANDPIPER_SIM_DUMP and SANDPIPER_SIM_DUMP_EVERY, NULL turns dumping off
+void SPSimSetDumpDirectory(const char *directory, int everyVBlank);
+
+// Write the current scanout as a 640x480 PPM image, returns 0 on success
+int SPSimDumpFrame(const char *path);
+
+// Current simulated time, and a way to let it pass as if the program spent that long computing
+uint64_t SPSimTime(void);
+void SPSimAdvance(uint64_t nanoseconds);
+
+// The 32 Mbyte reserved memory region, byte 0 is physical address 0x18000000
+uint8_t *SPSimMemory(void);
+
+void SPSimGetStats(struct SPSimStats *stats);
+void SPSimPrintStats(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif